@@ -15,6 +15,8 @@
 #define CRADLEFUNCTIONS_H
 
 #include <opencv2/opencv.hpp>
+#include <map>
+#include <memory>
 #include <vector>
 
 
@@ -57,12 +59,82 @@ namespace CradleFunctions{
 		std::vector<std::vector<int>> pieceIDh;		//Array of cradle segment identifiers corresponding to each horizontal cradle piece
 		std::vector<std::vector<int>> pieceIDv;		//Array of cradle segment identifiers corresponding to each vertical cradle piece
 		std::vector<cv::Point2i> piece_middle;		//Middle coordinate of each cradle segment (needed by the Platypus interface)
+		std::vector<int> piece_h;					//Horizontal cradle piece containing each segment identifier, -1 if none (see buildPieceLookup)
+		std::vector<int> piece_v;					//Vertical cradle piece containing each segment identifier, -1 if none (see buildPieceLookup)
+	};
+
+	//Intensity statistics of a single cradle segment, as collected by pieceStatistics()
+	struct piece_statistics{
+		int count;			//Number of pixels in the segment
+		uchar median;		//Median intensity
+		uchar min, max;		//Intensity range
+	};
+
+	//Outline of a connected region of a cradle segment, as traced by pieceOutlines(). A segment split
+	//into several regions (e.g. by a defect crossing it) has one outline per region.
+	struct piece_outline{
+		int piece;							//Segment identifier (value in the piece mask)
+		std::vector<cv::Point> points;		//Outer boundary in image coordinates (x = column, y = row)
+	};
+
+	//Running-mean smoothing of an image, evaluated lazily one line at a time.
+	//VERTICAL_DIR smooths along columns (as cv::filter2D with a ksize x 1 box kernel),
+	//HORIZONTAL_DIR along rows (1 x ksize kernel) and CROSS_DIR with a ksize x ksize box.
+	//A line is only computed the first time one of its pixels is requested, in O(1) per pixel,
+	//and only over the current band; lines are kept until the band changes or is released.
+	class SmoothedImage{
+	public:
+		SmoothedImage(const cv::Mat &img, int ksize, int axis);
+
+		float at(int r, int c);		//Smoothed value of pixel (r, c), which must lie in the band
+
+		//Evaluate only inside 'band' (the whole image initially) and release the lines computed so far
+		void setBand(const cv::Rect &band);
+
+		//Release the lines computed so far, keeping the band
+		void release();
+
+		int rows, cols;
+
+	private:
+		const std::vector<float> &line(int index);
+
+		cv::Mat img;							//Source image (CV_32F)
+		int ksize;								//Length of the box kernel
+		int axis;								//Smoothing direction
+		cv::Rect band;							//Pixels that may be requested
+		std::unique_ptr<SmoothedImage> rowsource;	//Horizontally smoothed rows used by CROSS_DIR
+		std::vector<std::vector<float>> lines;	//Computed columns (VERTICAL_DIR) or rows over the band, empty until requested
+	};
+
+	//Smoothed versions of the input image used by the removal stages of a single run; each stage
+	//restricts them to the piece it works on and releases them when it is done
+	class SmoothingCache{
+	public:
+		explicit SmoothingCache(const cv::Mat &img);
+
+		SmoothedImage &vertical(int ksize);
+		SmoothedImage &horizontal(int ksize);
+		SmoothedImage &box(int ksize);
+
+		//Release every smoothed image, once a removal stage is done with them
+		void release();
+
+	private:
+		SmoothedImage &get(int ksize, int axis);
+
+		cv::Mat img;
+		std::map<std::pair<int, int>, std::unique_ptr<SmoothedImage>> images;
 	};
 
 	//Callback functions for the interface
 	struct Callbacks
 	{
 		virtual bool progress(int value, int total) const = 0;
+
+		//A finished part of the result: 'pixels' (float) now hold the output over 'rect'. Parts may be
+		//published again when a later pass changes them. Return false to cancel.
+		virtual bool region(const cv::Rect &rect, const cv::Mat &pixels) const { return true; }
 	};
 
 	void removeCradle(
@@ -92,6 +164,16 @@ namespace CradleFunctions{
 		std::vector<std::vector<std::vector<float>>> &vm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
 	);
+	void removeVertical(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked vertical and/or horizontal cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of vertical cradle pieces
+		std::vector<int> s,									//Width of vertical cradle pieces
+		std::vector<std::vector<std::vector<float>>> &vm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
+		MarkedSegments &ms,									//MarkedSegment structure will contain processing information
+		SmoothingCache &smoothing							//Smoothed image bands, shared with the other removal stages
+	);
 	void removeHorizontal(
 		const cv::Mat &img,									//Input grayscale float X-ray image
 		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
@@ -101,6 +183,16 @@ namespace CradleFunctions{
 		std::vector<std::vector<std::vector<float>>> &hm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
 	);
+	void removeHorizontal(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of horizontal cradle pieces
+		std::vector<int> s,									//Width of horizontal cradle pieces
+		std::vector<std::vector<std::vector<float>>> &hm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
+		MarkedSegments &ms,									//MarkedSegment structure will contain processing information
+		SmoothingCache &smoothing							//Smoothed image bands, shared with the other removal stages
+	);
 	void removeCrossSection(
 		const cv::Mat &img,									//Input grayscale float X-ray image
 		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
@@ -113,6 +205,19 @@ namespace CradleFunctions{
 		std::vector<std::vector<std::vector<float>>> &vm,	//Parameters of the fitted multiplicative model for vertical cradle pieces
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
 	);
+	void removeCrossSection(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<int> &hrange,							//Width of horizontal cradle pieces
+		std::vector<int> &vrange,							//Width of vertical cradle pieces
+		std::vector<std::vector<int>> &midposh_points,		//Center of horizontal cradle pieces
+		std::vector<std::vector<int>> &midposv_points,		//Center of vertical cradle pieces
+		std::vector<std::vector<std::vector<float>>> &hm,	//Parameters of the fitted multiplicative model for horizontal cradle pieces
+		std::vector<std::vector<std::vector<float>>> &vm,	//Parameters of the fitted multiplicative model for vertical cradle pieces
+		MarkedSegments &ms,									//MarkedSegment structure will contain processing information
+		SmoothingCache &smoothing							//Smoothed image bands, shared with the other removal stages
+	);
 
 	//Guided cradle detection
 	void cradledetect(
@@ -159,6 +264,9 @@ namespace CradleFunctions{
 	float getMedian(std::vector<float> &v);
 	float getVariance(std::vector<float> &v);
 	float getVariance(cv::Mat v);
+	std::vector<piece_statistics> pieceStatistics(const cv::Mat &in, const cv::Mat &cradle, const cv::Mat &piece_mask, int pieces);
+	std::vector<piece_outline> pieceOutlines(const cv::Mat &piece_mask, int pieces);
+	void buildPieceLookup(MarkedSegments &ms);
 	void writeMarkedSegmentsFile(std::string name, MarkedSegments ms);
 	MarkedSegments readMarkedSegmentsFile(std::string name);
 
@@ -166,5 +274,6 @@ namespace CradleFunctions{
 	void setCallbacks(const Callbacks *callbacks);
 	const Callbacks *callbacks();
 	bool progress(int value, int total);
+	bool region(const cv::Rect &rect, const cv::Mat &pixels);
 }
 #endif
\ No newline at end of file
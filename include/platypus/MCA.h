@@ -27,13 +27,15 @@ namespace MCA{
 	const int DTWDC		=	1;		//Dual-tree wavelet decomposition dictionary
 	const int FDCT		=	2;		//Curvelet decomposition dictionary
 
-	//Separate image 'in' into a texture and cartoon part using the dictionaries specified in dict
-	void MCA_Bcr(cv::Mat &in, std::vector<int> &dict, cv::Mat &texture, cv::Mat &cartoon);
+	//Separate image 'in' into a texture and cartoon part using the dictionaries specified in dict.
+	//'in' is zero-padded to 'n' x 'n' (a power of two, at least 256), the size of texture and cartoon.
+	void MCA_Bcr(cv::Mat &in, std::vector<int> &dict, cv::Mat &texture, cv::Mat &cartoon, int n = 512);
 	
 	//Auxiliary functions for the MCA decomposition
 	//More details are given in the Matlab code from which these functions were translated
 	cv::Mat TVCorrection(cv::Mat &x, float gamma);
 	float softThreshold(float val, float lambda);
+	int curveletScales(int n);
 	void calculateL2Norm(int n, std::vector<int> &dict, std::vector<std::vector<std::vector<float>>> &norm);
 	float startingPoint(cv::Mat &in, std::vector<int> &dict, std::vector<std::vector<std::vector<float>>> &norm);
 	cv::Mat analysis_threshold_synthesis(cv::Mat &in, int dict, float lambda, std::vector<std::vector<float>> &norm);
@@ -16,6 +16,10 @@
 
 #include <platypus/CradleFunctions.h>
 #include <opencv2/opencv.hpp>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
 #include <vector>
 
 /**
@@ -42,50 +46,279 @@ namespace TextureRemoval{
 		std::vector<cv::Mat> kappa_v;
 		std::vector<cv::Mat> Gamma_v;
 		std::vector<float> rho_v;
-		std::vector<cv::Mat> xi_v;
 		std::vector<cv::Mat> Lambda_v;
 		std::vector<cv::Mat> ps_v;
+
+		//Per-sample latent factors of every draw; post_inference() does not use them, so they are
+		//only kept on request (gibbs_settings::keep_latent) and empty otherwise
+		std::vector<cv::Mat> xi_v;
 		std::vector<cv::Mat> etac_v;
 		std::vector<cv::Mat> etanc_v;
+
+		int burn_in = 0;							//Burn-in iterations used before the draws were kept
+		int iterations = 0;							//Total Gibbs iterations run (burn-in + kept draws)
+		float rhat = 0;								//Largest split R-hat of the monitored traces when burn-in ended
+
+		//Cradle component averaged over all draws, as an affine map of the cradle coefficients
+		//c (one sample per row): c * W + b. Filled by foldModel(); empty if not folded.
+		cv::Mat W;
+		cv::Mat b;
+	};
+
+	//Buffers for the k x k draws of one factor block of the Gibbs sampler (see gibbs_workspace)
+	struct gibbs_factor{
+		cv::Mat U;										//Upper Cholesky factor of the current posterior precision
+		cv::Mat diagP, Q, b, z;							//Row update system Q * x = b and its standard normal draw
+		cv::Mat matlocal;
+	};
+
+	//Working matrices of gibbsSampling(). They are reused across iterations and, when the same workspace
+	//is passed again, across calls: a buffer is only reallocated when one of its dimensions changes
+	//(other sample counts, or k1/k2 adapted during burn-in).
+	struct gibbs_workspace{
+		cv::Mat cradleMat, noncradleMat;
+		cv::Mat Lmsg, Lmsgt, Veta1;
+		cv::Mat prod_nc, eta_nctmp;
+		cv::Mat prod_c, eta_ctmp;
+		cv::Mat gammatrans, lambdatrans;
+		cv::Mat eta2_nc, eta_nct, alam;
+		cv::Mat Gmsg, Gmsgt, Vxi1;
+		cv::Mat resid, prod_xi, xi_noise;
+		cv::Mat xi2, xit, agam;
+		gibbs_factor lam, gam;							//k1 (eta, Lambda) and k2 (xi, Gamma) sized buffers
+		std::vector<float> colsum, lind, xisum;
+	};
+
+	//Counter-based random bit generator (Philox4x32-10). Its output is a fixed function of a key and a 128-bit
+	//counter, so draws are addressed by e.g. (iteration, stream, row, column) and come out the same whatever
+	//order or thread they are drawn in. Usable with the <random> distributions.
+	class PhiloxEngine{
+	public:
+		typedef uint32_t result_type;
+
+		explicit PhiloxEngine(uint64_t key = 0) : key(key), ctr{ { 0, 0, 0, 0 } }, pos(4) {}
+
+		//Restart at the beginning of the sequence with counter words (c1, c2, c3)
+		void seek(uint32_t c1, uint32_t c2 = 0, uint32_t c3 = 0){
+			ctr = { { 0, c1, c2, c3 } };
+			pos = 4;
+		}
+
+		result_type operator()(){
+			if (pos == 4){
+				buf = block(key, ctr);
+				ctr[0]++;
+				pos = 0;
+			}
+			return buf[pos++];
+		}
+
+		static constexpr result_type min(){ return 0; }
+		static constexpr result_type max(){ return 0xFFFFFFFFu; }
+
+		//The four output words for 'counter' under 'key'
+		static std::array<uint32_t, 4> block(uint64_t key, std::array<uint32_t, 4> counter);
+
+	private:
+		uint64_t key;
+		std::array<uint32_t, 4> ctr, buf;
+		int pos;
+	};
+
+	//Fill the float matrix 'm' with standard normal draws; element (i, j) depends on (key, c1, c2, i, j) only
+	void fillNormal(cv::Mat &m, uint64_t key, uint32_t c1, uint32_t c2);
+
+	//Uniformly drawn subset of at most 'capacity' samples of a stream of feature vectors, so the training set
+	//of a class is selected while sampling, without keeping every sample around. The samples with the smallest
+	//random priorities are kept: the subset does not depend on the order the samples arrive in.
+	class SampleReservoir{
+	public:
+		SampleReservoir(int capacity, int dim) : capacity(capacity), dim(dim) {}
+
+		void add(const float *f, uint64_t priority);
+
+		//Kept samples, by increasing priority
+		std::vector<std::vector<float>> samples() const;
+
+	private:
+		size_t capacity, dim;
+		std::vector<std::pair<uint64_t, size_t>> heap;	//Max-heap of (priority, slot in data)
+		std::vector<float> data;
+	};
+
+	//Take 'cnt' samples, selected randomly (std::rand, with replacement) from 'dts' and returned in 'samples'
+	[[deprecated("textureRemove() selects its training sets with SampleReservoir")]]
+	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt);
+
+	//Length of the Gibbs chain. Burn-in ends once the split R-hat of the monitored traces (tr(Lambda*Lambda'),
+	//tr(Gamma*Gamma'), mean noise precision) over the last 'window' iterations drops below 'rhat', but not
+	//before 'min_burn' nor after 'max_burn' iterations; 'samples' draws are kept afterwards.
+	//With adaptive = false, burn-in always takes 'max_burn' iterations. The per-sample latent factors of the
+	//kept draws (xi_v, etac_v, etanc_v) are only stored with keep_latent = true.
+	struct gibbs_settings{
+		int min_burn = 100;
+		int max_burn = 500;
+		int samples = 100;
+		int window = 50;
+		float rhat = 1.05f;
+		bool adaptive = true;
+		bool keep_latent = false;
+		const cradle_model_fitting *seed = nullptr;	//Start the chain from the last draw of this model (same p), if set
 	};
 
 	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle);
+	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle, gibbs_workspace &ws,
+		const gibbs_settings &settings = gibbs_settings());
+
+	//Write/read a trained model (kept draws, folded operator and chain report; no latent draws) in a compact
+	//binary format. Return false on I/O errors or, when loading, on a file that is not a valid model.
+	bool saveModel(const cradle_model_fitting &model, const std::string &path);
+	bool loadModel(const std::string &path, cradle_model_fitting &model);
+
+	//Fold the posterior mean of every kept draw into the affine operator (W, b) of 'model'
+	void foldModel(cradle_model_fitting &model);
 	
 	//Function responsible for separation
 	void post_inference(
 		cradle_model_fitting &model,				//Statistical model to be used for the separation
 		std::vector<std::vector<float>> &c,			//Coefficients of the cradle component to be separated
-		std::vector<std::vector<float>> &nc,		//Samples of non-cradled doefficients
+		std::vector<std::vector<float>> &nc,		//Samples of non-cradled doefficients (do not affect the posterior mean)
 		std::vector<std::vector<float>> &difference	//Separation result is stored here 
 	);
 
+	//As above, on samples kept one per row of a CV_32F matrix (e.g. interleaveSubbands() features)
+	void post_inference(cradle_model_fitting &model, const cv::Mat &c, cv::Mat &difference);
+
+	//Layout of the processing blocks of textureRemove(): 'size' x 'size' pixel blocks, neighbouring blocks
+	//overlapping by 'overlap' pixels. Less overlap means fewer blocks to transform, more risks seams; smaller
+	//blocks mean smaller transforms and coefficient caches, but more blocks and seams.
+	struct block_layout{
+		int size = 512;
+		int overlap = 48;
+	};
+
+	//Whether the shearlet transforms support 'size' x 'size' blocks: 256, 512 or 1024
+	bool supportedBlockSize(int size);
+
+	//Whether textureRemove() accepts 'layout': a supported block size and an even overlap below half of it
+	bool validBlockLayout(const block_layout &layout);
+
+	//Processing blocks of an image and the work planned for them. Blocks are laid out on the image padded by
+	//'pad' pixels on every side; coords holds (first row, first column, end row, end column) of each block.
+	struct block_plan{
+		int pad = 0;
+		std::vector<std::vector<int>> coords;
+		std::vector<bool> reconstructed;	//Blocks with cradle samples: separated and written back
+		std::vector<bool> sampled;			//Blocks training samples are drawn from
+		std::vector<int> decomposed;		//Blocks that need MCA: those whose centre lies in a sampled block
+	};
+
+	//Blocks textureRemove() processes for this mask and piece mask
+	block_plan planBlocks(const cv::Mat &mask, const cv::Mat &piece_mask, const block_layout &layout);
+
+	//Default of texture_removal_options::cache_bytes: the budget is sized by textureRemove() to its blocks
+	const size_t auto_cache_bytes = size_t(-1);
+
+	//Per-user cache directory for spilled data ($XDG_CACHE_HOME, ~/.cache, ~/Library/Caches or
+	//%LOCALAPPDATA%, followed by /platypus); empty if the platform location is unknown
+	std::string defaultCacheDirectory();
+
+	//Settings of a textureRemove() run
+	struct texture_removal_options{
+		block_layout layout;				//Processing blocks; must pass validBlockLayout()
+		gibbs_settings gibbs;				//Chain length of the model fits
+
+		//Memory budget for the forward shearlet coefficients kept per processing block between the
+		//sampling and separation passes. Blocks evicted beyond the budget are spilled to 'cache_dir'
+		//(created if missing) and read back on demand; without a spill directory they are recomputed.
+		//By default the budget holds every sampled block, up to a quarter of the physical memory.
+		size_t cache_bytes = auto_cache_bytes;
+		std::string cache_dir = defaultCacheDirectory();
+
+		//Memory budget for the working texture, kept in tiles. Tiles beyond the budget are spilled to a
+		//file in 'texture_dir'; without a spill directory the whole texture stays in memory.
+		size_t texture_bytes = size_t(4) << 30;
+		std::string texture_dir;
+
+		//Directory of trained models to reuse (none if empty). Models are stored under a hash of the
+		//normalized training samples and the sampler settings, so unchanged pieces skip gibbsSampling().
+		//With 'warm_start', a piece that has to be trained starts its chain from the previous model
+		//trained for the same direction.
+		std::string model_dir;
+		bool warm_start = false;
+	};
+
+	//Work done by a textureRemove() run
+	struct texture_removal_report{
+		int blocks = 0;			//Processing blocks covering the image
+		int decomposed = 0;		//Blocks that went through MCA
+		int sampled = 0;		//Blocks training samples were drawn from
+	};
+
 	//Entry point to texture separation
-	Status textureRemove(
-		cv::Mat &in,								//Input image for wood grain separation
-		cv::Mat &mask,								//Mask component, as returned by cradle removal step
-		cv::Mat &out,								//Result image is stored here
-		const CradleFunctions::MarkedSegments &ms	//Processing information, as returned by cradle removal step
+	Status textureRemove(
+		cv::Mat &in,								//Input image for wood grain separation
+		cv::Mat &mask,								//Mask component, as returned by cradle removal step
+		cv::Mat &out,								//Result image is stored here
+		const CradleFunctions::MarkedSegments &ms,	//Processing information, as returned by cradle removal step
+		const texture_removal_options &options = texture_removal_options(),
+		texture_removal_report *report = nullptr	//Work done by the run, if set
 	);
 
-	//Take 'cnt' samples, selected randomly from 'dts' and returned in 'samples' 
-	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt);
+	//Copy the subbands flagged in 'target' at every (rstep, cstep)-th pixel of a 'size' region into
+	//'features', pixel-interleaved: each row holds the target_dim coefficients of one pixel
+	void interleaveSubbands(const std::vector<cv::Mat> &coeffs, const int *target, cv::Size size, int rstep, int cstep, cv::Mat &features);
+
+	//Scatter pixel-interleaved 'features' back into the subbands flagged in 'target'
+	void deinterleaveSubbands(const cv::Mat &features, const int *target, cv::Size size, int rstep, int cstep, std::vector<cv::Mat> &coeffs);
+
+	//Exact k nearest neighbours (squared L2 distance d) of every row of 'queries' among the rows of 'points',
+	//and the weighted average of their rows in 'values' with weights 1 / (1 + d): one row of 'out' per query
+	void knnInterpolate(const cv::Mat &queries, const cv::Mat &points, const cv::Mat &values, int k, cv::Mat &out);
+
+	//Shearlet coefficients of a square block of a supported size, only the subbands flagged in 'subbands' (all of
+	//them if empty); the others are returned empty. At 512 this is FFST::shearletTransformSpect() (to rounding),
+	//other sizes use the FFST filters resampled to their frequency grid.
+	std::vector<cv::Mat> shearletTransform(const cv::Mat &block, const std::vector<bool> &subbands = std::vector<bool>());
+
+	//Block reconstructed from all of its shearletTransform() coefficients
+	cv::Mat inverseShearletTransform(std::vector<cv::Mat> &coeffs);
 
 	//Reconstruct image block between points (sx,sy) (ex,ey) with a local shift of (csx,csy)
 	void reconstructBlock(cv::Mat &texture, std::vector<cv::Mat> &coeffs, int sx, int sy, int csx, int csy, int cex, int cey);
+
+	//As above, but the block centre is returned instead of written, as image rectangles and their pixels: the
+	//part inside 'inner' in 'part' (empty rectangle if none), the rest, which neighboring blocks may still
+	//read, appended to 'deferred'
+	void reconstructBlock(std::vector<cv::Mat> &coeffs, int sx, int sy, int csx, int csy, int cex, int cey,
+		const cv::Rect &inner, std::pair<cv::Rect, cv::Mat> &part, std::vector<std::pair<cv::Rect, cv::Mat>> &deferred);
 	
 	//Normalize non-cradle samples, return sample mean and variance
 	void normalizeNonCradle(std::vector<std::vector<float>> &nc, std::vector<float> &mean, std::vector<float> &var);
 
 	//Normalize cradle samples using mean and variance specified
 	void normalizeSamples(std::vector<std::vector<float>> &c, std::vector<float> &mean, std::vector<float> &var);
+	void normalizeSamples(cv::Mat &c, const std::vector<float> &mean, const std::vector<float> &var);
 
 	//Undo normalization
 	void unNormalizeSamples(std::vector<std::vector<float>> &cradle, std::vector<float> &mean, std::vector<float> &var);
+	void unNormalizeSamples(cv::Mat &cradle, const std::vector<float> &mean, const std::vector<float> &var);
 	void unNormalizeSamplesCrossSection(std::vector<std::vector<float>> &cradle, std::vector<float> &meanh, std::vector<float> &varh, std::vector<float> &meanv, std::vector<float> &varv);
 	
 	//Cholesky decomposition of matrix A
 	cv::Mat Cholesky(cv::Mat &A);
 	cv::Mat CholeskyLower(cv::Mat &A);
+	void Cholesky(const cv::Mat &A, cv::Mat &U);
+	void CholeskyLower(const cv::Mat &A, cv::Mat &L);
+
+	//Symmetric positive definite systems A, given by the upper triangular factor U of A = U'*U
+	//as computed by Cholesky(): only triangular substitutions, no explicit inverses.
+	//X = B * inv(A), one right-hand side per row of B (X may be B)
+	void spdSolveRows(const cv::Mat &U, const cv::Mat &B, cv::Mat &X);
+	//X = B * inv(A) + Z * inv(U)': rows drawn from N(B * inv(A), inv(A)) for standard normal rows Z (X may be B)
+	void spdSampleRows(const cv::Mat &U, const cv::Mat &B, const cv::Mat &Z, cv::Mat &X);
+	//X = inv(A) * B
+	void spdSolve(const cv::Mat &U, const cv::Mat &B, cv::Mat &X);
 
 	//Sampling from multi-variate normal distribution with 'mean' and 'covar' covariance specified
 	std::vector<float> mvnpdf(std::vector<std::vector<float>> &X, std::vector<float> &mean, cv::Mat &covar);
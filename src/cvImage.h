@@ -4,6 +4,7 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/types_c.h>
 #include <opencv2/core/core_c.h>
+#include <memory>
 #undef min
 #undef max
 
@@ -52,6 +53,8 @@ public:
                 cvReleaseImage(&m_image);
         }
 		m_image = image;
+		m_header = false;
+		m_storage.reset();
 		return *this;
 	}
 
@@ -79,11 +82,21 @@ public:
 			}
 			m_image = rhs.m_image;
             m_header = rhs.m_header;
+			m_storage = std::move(rhs.m_storage);
 			rhs.m_image = NULL;
 		}
 		return *this;
 	}
 
+	// take a header over pixel data owned by storage, which is kept alive as long as the image
+	cvImageRef &reset(IplImage *header, std::shared_ptr<void> storage)
+	{
+		*this = header;
+		m_header = true;
+		m_storage = std::move(storage);
+		return *this;
+	}
+
 	IplImage *get() const { return m_image; }
 
 	operator IplImage *()
@@ -114,6 +127,7 @@ public:
 private:
 	IplImage *m_image;
   bool m_header;
+	std::shared_ptr<void> m_storage;
 };
 
 #endif
@@ -8,6 +8,10 @@
 #include <QtCore/QDebug>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QFileInfo>
+#include <QtCore/QDir>
+#include <QtCore/QSettings>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QTemporaryFile>
 #include <QtConcurrent/QtConcurrentRun>
 #include <cmath>
 #include <limits>
@@ -17,6 +21,14 @@ static ImageManager *s_instance;
 static const int kMaxImageSize = 32768;
 static const int kMinSize = 1024;
 
+// images larger than this are memory mapped from a temporary file, so the
+// full-size working buffers of very large scans are paged by the OS instead
+// of having to fit in RAM together
+static const qint64 kMappedImageBytes = qint64(512) << 20;
+
+static qint64 s_mappedImageBytes = kMappedImageBytes;
+static QString s_spillDirectory;
+
 namespace
 {
 QVector<QRgb> grayColorTable()
@@ -423,6 +435,63 @@ void ImageManager::load(const QString &displayName, const QImage &image)
     m_watcher->setFuture(future);
 }
 
+QString ImageManager::spillDirectory()
+{
+    if (!s_spillDirectory.isEmpty())
+        return s_spillDirectory;
+
+    QSettings settings;
+    QString dir = settings.value("/spillDir").toString();
+    if (dir.isEmpty())
+        dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    return dir;
+}
+
+void ImageManager::setSpillDirectory(const QString &dir)
+{
+    s_spillDirectory = dir;
+}
+
+qint64 ImageManager::mappedImageBytes()
+{
+    return s_mappedImageBytes;
+}
+
+void ImageManager::setMappedImageBytes(qint64 bytes)
+{
+    s_mappedImageBytes = bytes;
+}
+
+void ImageManager::createImage(cvImageRef &image, CvSize size, int depth)
+{
+    int step = (size.width * ((depth & 0xFF) / 8) + 3) & ~3;
+    qint64 bytes = qint64(step) * size.height;
+    if (bytes > s_mappedImageBytes)
+    {
+        QString path = spillDirectory();
+        QDir dir(path);
+        if (path.isEmpty() || !dir.mkpath("."))
+        {
+            qWarning() << "Unable to use spill directory" << path << ", using" << QDir::tempPath();
+            dir = QDir(QDir::tempPath());
+        }
+        auto file = std::make_shared<QTemporaryFile>(dir.filePath("platypus-XXXXXX.raw"));
+        uchar *data = nullptr;
+        if (file->open() && file->resize(bytes))
+            data = file->map(0, bytes);
+        if (data)
+        {
+            // the mapping is released when the file is closed with the last reference
+            IplImage *header = cvCreateImageHeader(size, depth, 1);
+            cvSetData(header, data, step);
+            image.reset(header, file);
+            return;
+        }
+        qWarning() << "Unable to map image storage, using memory instead:" << file->errorString();
+    }
+    image = cvCreateImage(size, depth, 1);
+}
+
 void ImageManager::clear()
 {
     m_loadingDisplayName.clear();
@@ -459,9 +528,9 @@ void ImageManager::onLoadFinished()
         m_source = source;
 
         CvSize size = cvSize(source->size().width(), source->size().height());
-        m_float = cvCreateImage(size, IPL_DEPTH_32F, 1);
-        m_result = cvCreateImage(size, IPL_DEPTH_32F, 1);
-        m_removeMask = cvCreateImage(size, IPL_DEPTH_16U, 1);
+        createImage(m_float, size, IPL_DEPTH_32F);
+        createImage(m_result, size, IPL_DEPTH_32F);
+        createImage(m_removeMask, size, IPL_DEPTH_16U);
 
         // convert to float
         QImage image = source->getTile(QRect(QPoint(0, 0), source->size()), source->size());
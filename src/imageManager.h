@@ -32,6 +32,18 @@ public:
     const cvImageRef &resultImage() const { return m_result; }
     const cvImageRef &removeMask() const { return m_removeMask; }
 
+    // allocate a single channel image; ones above mappedImageBytes() are backed by a temporary file
+    // in spillDirectory()
+    static void createImage(cvImageRef &image, CvSize size, int depth);
+
+    // directory of the files backing large images: set by setSpillDirectory(), else the "/spillDir"
+    // setting, else the application cache directory (on disk, where the temp directory may be in RAM)
+    static QString spillDirectory();
+    static void setSpillDirectory(const QString &dir);
+
+    static qint64 mappedImageBytes();
+    static void setMappedImageBytes(qint64 bytes);
+
 Q_SIGNALS:
 	void imageChanged();
 	void status(const QString &msg);
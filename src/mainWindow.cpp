@@ -6,6 +6,7 @@
 #include <viewerScroller.h>
 #include <project.h>
 #include <polygon.h>
+#include <mask.h>
 #include <undoManager.h>
 #include <polygonCommands.h>
 #include <removeSource.h>
@@ -45,6 +46,7 @@
 #include <QtCore/QSettings>
 #include <QtCore/QDir>
 #include <QtCore/QFileInfo>
+#include <QtCore/QThread>
 #include <QtCore/QLine>
 
 static const char *kProjectExtension = "platypus";
@@ -1397,37 +1399,18 @@ void MainWindow::onTab(int index)
         updateSliders();
 }
 
-static void buildMask(IplImage *result, const QImage &mask, unsigned char bitMask)
-{
-    for (int y = 0; y < result->height; y++)
-    {
-        uchar *drow = iplImageRow<uchar>(result, y);
-        const uchar *srow = mask.scanLine(y);
-        for (int x = 0; x < result->width; x++)
-        {
-            if (srow[x])
-                drow[x] |= bitMask;
-        }
-    }
-}
-
 void MainWindow::onDetectCradle()
 {
     DetectCradleDialog dialog(this);
     if (dialog.exec() == QDialog::Rejected)
         return;
 
-    // render the defect mask
+    // rasterize the defect mask into an OpenCV image as the DEFECT bit
     QSize size = ImageManager::get().size();
-    QImage maskImage(size, QImage::Format_Mono);
-    maskImage.fill(0);
-    m_project->renderMask(maskImage);
-    maskImage = maskImage.convertToFormat(QImage::Format_Indexed8);
-
-    // wrap it in OpenCV image and setr the DEFECT bit
-    cvImageRef maskWrapper(cvCreateImage(cvSize(size.width(), size.height()), IPL_DEPTH_8U, 1));
+    cvImageRef maskWrapper;
+    ImageManager::createImage(maskWrapper, cvSize(size.width(), size.height()), IPL_DEPTH_8U);
     std::memset(maskWrapper->imageData, 0, maskWrapper->imageSize);
-    buildMask(maskWrapper, maskImage, CradleFunctions::DEFECT);
+    rasterizeMask(maskWrapper, m_project->maskPath(size), CradleFunctions::DEFECT);
     auto arr_to_mat = [](auto&& imageref) {
         return cv::cvarrToMat(imageref.get());
     };
@@ -1478,62 +1461,30 @@ void MainWindow::onDetectCradle()
     m_viewer->setTool(Viewer::kTool_Polygon);
 }
 
-static cvImageRef buildMask(const Project *project)
+static void buildMask(cvImageRef &mask, const Project *project)
 {
 	auto polygons = project->polygons();
 
 	QSize size = ImageManager::get().size();
-    cvImageRef mask(cvCreateImage(cvSize(size.width(), size.height()), IPL_DEPTH_8U, 1));
+    ImageManager::createImage(mask, cvSize(size.width(), size.height()), IPL_DEPTH_8U);
     std::memset(mask->imageData, 0, mask->imageSize);
 
 	// render the defect mask
-	{
-		QImage maskImage(size, QImage::Format_Mono);
-		maskImage.fill(0);
-		project->renderMask(maskImage);
-		maskImage = maskImage.convertToFormat(QImage::Format_Indexed8);
-		buildMask(mask, maskImage, CradleFunctions::DEFECT);
-	}
-
-	// now add horizontal pieces
-	{
-		QImage maskImage(size, QImage::Format_Mono);
-		maskImage.fill(0);
-		QPainter painter(&maskImage);
-		painter.setPen(Qt::NoPen);
-		painter.setBrush(Qt::white);
-		QPainterPath path;
-		for (auto p : polygons)
-		{
-			if (p->type() == Polygon::INPUT && p->isHorizontal())
-				path.addPath(p->path());
-		}
-		painter.drawPath(path);
-		painter.end();
-		maskImage = maskImage.convertToFormat(QImage::Format_Indexed8);
-		buildMask(mask, maskImage, CradleFunctions::H_MASK);
-	}
+	rasterizeMask(mask, project->maskPath(size), CradleFunctions::DEFECT);
 
-	// now add vertical pieces
+	// now add horizontal and vertical pieces
+	QPainterPath hPath, vPath;
+	for (auto p : polygons)
 	{
-		QImage maskImage(size, QImage::Format_Mono);
-		maskImage.fill(0);
-		QPainter painter(&maskImage);
-		painter.setPen(Qt::NoPen);
-		painter.setBrush(Qt::white);
-		QPainterPath path;
-		for (auto p : polygons)
-		{
-			if (p->type() == Polygon::INPUT && !p->isHorizontal())
-				path.addPath(p->path());
-		}
-		painter.drawPath(path);
-		painter.end();
-		maskImage = maskImage.convertToFormat(QImage::Format_Indexed8);
-		buildMask(mask, maskImage, CradleFunctions::V_MASK);
+		if (p->type() != Polygon::INPUT)
+			continue;
+		if (p->isHorizontal())
+			hPath.addPath(p->path());
+		else
+			vPath.addPath(p->path());
 	}
-
-	return mask.detach();
+	rasterizeMask(mask, hPath, CradleFunctions::H_MASK);
+	rasterizeMask(mask, vPath, CradleFunctions::V_MASK);
 }
 void MainWindow::save(const QString &path)
 {
@@ -1549,7 +1500,8 @@ void MainWindow::save(const QString &path)
               return cv::cvarrToMat(imageref.get());
             };
 
-        	cvImageRef maskImage = buildMask(m_project);
+        	cvImageRef maskImage;
+        	buildMask(maskImage, m_project);
             QString maskPath = path + ".mask.tiff";
             cv::imwrite(maskPath.toUtf8().constData(), cv::Mat(arr_to_mat(maskImage)));
         }
@@ -1563,32 +1515,6 @@ void MainWindow::save(const QString &path)
 	}
 }
 
-static void buildPolygons(QList<QPolygon> &polygons, const QPainterPath &path)
-{
-    int i = 0;
-    QPolygon poly;
-    while (i < path.elementCount())
-    {
-        QPainterPath::Element e = path.elementAt(i);
-        if (e.isMoveTo())
-        {
-            if (poly.count() != 0)
-                polygons << poly;
-            poly.clear();
-            poly << QPoint(e.x, e.y);
-        }
-        else if (e.isLineTo())
-            poly << QPoint(e.x, e.y);
-        else if (e.isCurveTo())
-        {
-            poly << QPoint(e.x, e.y);
-        }
-        i++;
-    }
-    if (poly.count() != 0)
-        polygons << poly;
-}
-
 class CradleCallbacks : public CradleFunctions::Callbacks
 {
     MainWindow *m_window;
@@ -1621,36 +1547,16 @@ public:
 
         return !s_canceled;
     }
-};
 
-static uchar findMedian(const cv::Mat &sourceMat, const cv::Mat &resultMat, const cv::Mat &maskMat, int index)
-{
-    uchar result = 0;
-    std::vector<uchar> vec;
-    for (int y = 0; y < maskMat.rows; y++)
+    virtual bool region(const cv::Rect &rect, const cv::Mat &pixels) const
     {
-        const float *srow = (const float *)sourceMat.row(y).ptr();
-        const float *rrow = (const float *)resultMat.row(y).ptr();
-        const short *mrow = (const short *)maskMat.row(y).ptr();
-        const float *end = srow + maskMat.cols;
-        while (srow != end)
-        {
-            if (*mrow == index)
-            {
-                int v = *srow - *rrow;
-                v = v < 0 ? 0 : v > 255 ? 255 : v;
-                vec.push_back(v);
-            }
-            srow++;
-            rrow++;
-            mrow++;
-        }
+        ImageManager::get().removeSource()->updateRegion(QRect(rect.x, rect.y, rect.width, rect.height), pixels);
+        if (QThread::currentThread() == QCoreApplication::instance()->thread())
+            QApplication::processEvents();
+
+        return !s_canceled;
     }
-    std::sort(vec.begin(), vec.end());
-    if (!vec.empty())
-        result = vec[vec.size() / 2];
-    return result;
-}
+};
 
 static QLine extend(const QLine &input, const QRect &rect, Qt::Orientation o)
 {
@@ -1749,7 +1655,8 @@ void MainWindow::onRemoveCradle()
 
     ImageManager::get().removeSource()->setIsFinal(false);
 
-	cvImageRef maskImage = buildMask(m_project);
+	cvImageRef maskImage;
+	buildMask(maskImage, m_project);
 
     UndoManager::instance()->beginMacro(tr("Generate Removal Segments"));
 
@@ -1764,8 +1671,6 @@ void MainWindow::onRemoveCradle()
 	std::vector<std::vector<std::vector<float>>> h_vm;
 	std::vector<std::vector<std::vector<float>>> v_vm;
 
-    QPainterPath hPaths, vPaths;
-
     QRect rect(0, 0, source->width, source->height);
 
 	auto input_polygons = Project::activeProject()->polygons(Polygon::INPUT);
@@ -1782,7 +1687,6 @@ void MainWindow::onRemoveCradle()
                 UndoManager::instance()->push(new EditPolygonCommand(poly, points));
 
                 QPainterPath path = poly->path();
-                hPaths += path;
                 QLine line = poly->centerLine();
                 QRect boundingRect = path.controlPointRect().toRect();
 
@@ -1806,7 +1710,6 @@ void MainWindow::onRemoveCradle()
                 UndoManager::instance()->push(new EditPolygonCommand(poly, points));
 
                 QPainterPath path = poly->path();
-                vPaths += path;
                 QLine line = poly->centerLine();
                 QRect boundingRect = path.controlPointRect().toRect();
 
@@ -1848,62 +1751,48 @@ void MainWindow::onRemoveCradle()
 	ms.pieceIDh.resize(h_s.size());
 	ms.pieceIDv.resize(v_s.size());
 
+    // smoothed member bands are shared between the removal stages
+    CradleFunctions::SmoothingCache smoothing(sourceMat);
+
  	CradleFunctions::removeHorizontal(sourceMat, maskMat, resultMat,
-			h_midpoints, h_s, h_vm, ms);
+			h_midpoints, h_s, h_vm, ms, smoothing);
     if (!progress.isCanceled())
     {
         CradleFunctions::removeVertical(sourceMat, maskMat, resultMat,
-                v_midpoints, v_s, v_vm, ms);
+                v_midpoints, v_s, v_vm, ms, smoothing);
     }
 
     if (!progress.isCanceled())
     {
         CradleFunctions::removeCrossSection(sourceMat, maskMat, resultMat,
                 h_s, v_s,
-                h_midpoints, v_midpoints, h_vm, v_vm, ms);
+                h_midpoints, v_midpoints, h_vm, v_vm, ms, smoothing);
     }
 
     ImageManager::get().removeSource()->invalidate();
 
-    // build output polygons by intersecting all of the input polygons
-    {
-        QPainterPath subH = hPaths.subtracted(vPaths);
-        QPainterPath subV = vPaths.subtracted(hPaths);
-        QPainterPath intersected = vPaths.intersected(hPaths);
-
-        QList<QPolygon> output_polygons;
-        buildPolygons(output_polygons, subH);
-        buildPolygons(output_polygons, subV);
-        buildPolygons(output_polygons, intersected);
+    // intensity statistics of every piece, gathered in a single pass
+    std::vector<CradleFunctions::piece_statistics> stats =
+        CradleFunctions::pieceStatistics(sourceMat, resultMat, ms.piece_mask, ms.pieces);
 
-        for (auto poly : output_polygons)
-        {
-            PolygonPointer p(new Polygon(Polygon::OUTPUT));
-            p->set(poly);
+    // build output polygons from the labelled piece mask, one per connected region of a piece
+    for (const auto &outline : CradleFunctions::pieceOutlines(ms.piece_mask, ms.pieces))
+    {
+        QPolygon poly;
+        for (const cv::Point &pt : outline.points)
+            poly << QPoint(pt.x, pt.y);
 
-            int index = -1;
-            uchar median = 0;
-            QRect rect = poly.boundingRect();
+        PolygonPointer p(new Polygon(Polygon::OUTPUT));
+        p->set(poly);
 
-            // found out what output mask index this is
-            for (int i = 0; i < ms.pieces && index < 0; i++)
-            {
-                cv::Point p = ms.piece_middle[i];
-                // +++ COORDINATES ARE REVERSED!!! +++
-                if (rect.contains(QPoint(p.y, p.x)))
-                {
-                    index = i;
-                    median = findMedian(sourceMat, resultMat, ms.piece_mask, index);
-                }
-            }
-            p->setValue("index", index);
-            p->setValue("median", median);
-            p->setValue("black", 0);
-            p->setValue("white", 255);
-            p->setValue("gamma", 0);
+        // piece i is marked i + 1 in the piece mask
+        p->setValue("index", outline.piece - 1);
+        p->setValue("median", stats[outline.piece].median);
+        p->setValue("black", 0);
+        p->setValue("white", 255);
+        p->setValue("gamma", 0);
 
-            UndoManager::instance()->push(new AddPolygonCommand(p));
-        }
+        UndoManager::instance()->push(new AddPolygonCommand(p));
     }
 
     CradleFunctions::setCallbacks(nullptr);
@@ -1911,6 +1800,7 @@ void MainWindow::onRemoveCradle()
 
     UndoManager::instance()->endMacro();
 
+    CradleFunctions::buildPieceLookup(ms);
     Project::activeProject()->setMarkedSegments(ms);
 }
 
@@ -2143,7 +2033,8 @@ void MainWindow::onRemoveTexture()
             auto arr_to_mat = [](auto&& imageref) {
               return cv::cvarrToMat(imageref.get());
             };
-    cvImageRef mask = buildMask(m_project);
+    cvImageRef mask;
+    buildMask(mask, m_project);
     cv::Mat maskMat(arr_to_mat(mask));
 
     cv::Mat outMat;
@@ -2161,6 +2052,7 @@ void MainWindow::onRemoveTexture()
             outMat.copyTo(resultMat);
 
         CradleFunctions::setCallbacks(nullptr);
+        source->clearRegions();
         endProgress();
 
         TextureRemovalMessage message = textureRemovalMessage(status);
@@ -2173,6 +2065,7 @@ void MainWindow::onRemoveTexture()
     catch (const std::exception &e)
     {
         CradleFunctions::setCallbacks(nullptr);
+        source->clearRegions();
         endProgress();
         QMessageBox::critical(this, QCoreApplication::applicationName(), e.what());
         return;
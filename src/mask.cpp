@@ -1,8 +1,12 @@
 #include <mask.h>
+#include <cvImage.h>
 #include <QtCore/QXmlStreamReader>
 #include <QtCore/QXmlStreamWriter>
 #include <QtGui/QImage>
 #include <QtGui/QPainter>
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 Mask::Mask(QObject *parent) : QObject(parent)
 {
@@ -90,3 +94,63 @@ void Mask::render(QImage &image) const
 	p.end();
 }
 
+// Curves are flattened once, then row bands are filled in parallel straight into the mask.
+// Each band walks its rows top down with an active edge list: edges enter it when the scanline
+// reaches their top and leave it past their bottom, so a row only visits the edges crossing it.
+void rasterizeMask(IplImage *result, const QPainterPath &path, unsigned char bitMask)
+{
+	struct Edge
+	{
+		double y0, y1, x0, dxdy;
+	};
+
+	std::vector<Edge> edges;
+	for (const QPolygonF &poly : path.toSubpathPolygons())
+	{
+		for (int i = 0; i < poly.size(); i++)
+		{
+			QPointF a = poly[i];
+			QPointF b = poly[(i + 1) % poly.size()];
+			if (a.y() == b.y())
+				continue;
+			if (a.y() > b.y())
+				std::swap(a, b);
+			edges.push_back({ a.y(), b.y(), a.x(), (b.x() - a.x()) / (b.y() - a.y()) });
+		}
+	}
+	if (edges.empty())
+		return;
+
+	std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.y0 < b.y0; });
+
+	const int width = result->width;
+	cv::parallel_for_(cv::Range(0, result->height), [&](const cv::Range &range) {
+		std::vector<const Edge *> active;
+		std::vector<double> xs;
+		size_t next = 0;
+		for (int y = range.start; y < range.end; y++)
+		{
+			const double yc = y + 0.5;
+			while (next < edges.size() && edges[next].y0 <= yc)
+				active.push_back(&edges[next++]);
+			active.erase(std::remove_if(active.begin(), active.end(), [yc](const Edge *e) { return e->y1 <= yc; }),
+				active.end());
+			if (active.size() < 2)
+				continue;
+
+			xs.clear();
+			for (const Edge *e : active)
+				xs.push_back(e->x0 + (yc - e->y0) * e->dxdy);
+
+			std::sort(xs.begin(), xs.end());
+			uchar *drow = iplImageRow<uchar>(result, y);
+			for (size_t k = 0; k + 1 < xs.size(); k += 2)
+			{
+				int x0 = std::max(0, int(std::ceil(xs[k] - 0.5)));
+				int x1 = std::min(width, int(std::ceil(xs[k + 1] - 0.5)));
+				for (int x = x0; x < x1; x++)
+					drow[x] |= bitMask;
+			}
+		}
+	});
+}
@@ -6,6 +6,7 @@
 #include <QtGui/QPainterPath>
 
 class QImage;
+typedef struct _IplImage IplImage;
 
 class Mask : public QObject
 {
@@ -34,4 +35,8 @@ public slots:
 	void clear();
 };
 
+// Scanline rasterizer for the processing masks: sets bitMask on every pixel of 'result' (8 bit,
+// single channel) whose centre lies inside path, using the odd-even rule QPainter fills paths with
+void rasterizeMask(IplImage *result, const QPainterPath &path, unsigned char bitMask);
+
 #endif
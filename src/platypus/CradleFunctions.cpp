@@ -14,6 +14,7 @@
 #include <platypus/CradleFunctions.h>
 #include <platypus/TextureRemoval.h>
 #include <fstream>
+#include <mutex>
 
 /**
 * Collection of all functions that make cradle removal possible.
@@ -93,14 +94,18 @@ namespace CradleFunctions{
 		ms.piece_mask = cv::Mat(in.rows, in.cols, CV_16U, cv::Scalar(0));
 		ms.piece_middle = std::vector<cv::Point2i>();
 
+		//Smoothed bands are shared by all removal stages
+		SmoothingCache smoothing(in);
+
 		//Remove horizontal
-		removeHorizontal(in, mask, cradle, hmidpos, widthh, hm, ms);
+		removeHorizontal(in, mask, cradle, hmidpos, widthh, hm, ms, smoothing);
 
 		//Remove vertical
-		removeVertical(in, mask, cradle, vmidpos, widthv, vm, ms);
+		removeVertical(in, mask, cradle, vmidpos, widthv, vm, ms, smoothing);
 
 		//Remove cross sections
-		removeCrossSection(in, mask, cradle, widthh, widthv, hmidpos, vmidpos, hm, vm, ms);
+		removeCrossSection(in, mask, cradle, widthh, widthv, hmidpos, vmidpos, hm, vm, ms, smoothing);
+		buildPieceLookup(ms);
 
 		out = in - cradle;
 	}
@@ -450,13 +455,29 @@ namespace CradleFunctions{
 		std::vector<std::vector<std::vector<float>>> &vm,	//Parameters of the fitted multiplicative model for vertical cradle pieces
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
 		){
+		SmoothingCache smoothing(img);
+		removeCrossSection(img, mask, cradle, hrange, vrange, midposh_points, midposv_points, hm, vm, ms, smoothing);
+	}
+
+	//Remove cradle from cross-sections
+	void removeCrossSection(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<int> &hrange,							//Width of horizontal cradle pieces
+		std::vector<int> &vrange,							//Width of vertical cradle pieces
+		std::vector<std::vector<int>> &midposh_points,		//Center of horizontal cradle pieces
+		std::vector<std::vector<int>> &midposv_points,		//Center of vertical cradle pieces
+		std::vector<std::vector<std::vector<float>>> &hm,	//Parameters of the fitted multiplicative model for horizontal cradle pieces
+		std::vector<std::vector<std::vector<float>>> &vm,	//Parameters of the fitted multiplicative model for vertical cradle pieces
+		MarkedSegments &ms,									//MarkedSegment structure will contain processing information
+		SmoothingCache &smoothing							//Smoothed image bands, shared with the other removal stages
+		){
 
-		cv::Mat smooth, filtered;
 		int fs = 5;
-		smooth = cv::Mat(fs, fs, CV_32F, 1.0 / fs / fs); //5x5 uniform blur filter
 
-		//Store filtered image
-		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+		//5x5 uniform blur, only evaluated around the cross sections
+		SmoothedImage &filtered = smoothing.box(fs);
 
 		//Do a checkup to make sure there is no invalid cradle pixel i the image
 		for (int i = 0; i < cradle.rows; i++){
@@ -652,12 +673,13 @@ namespace CradleFunctions{
 							posth = k;
 					}
 
-					//Remove cradle part
+					//Remove cradle part, smoothing only this cross section
+					filtered.setBand(cv::Rect(cv::Point(sty, stx), cv::Point(eny + 1, enx + 1)));
 					for (int k = stx; k <= enx; k++){
 						for (int l = sty; l <= eny; l++){
 							if (cradle.at<float>(k, l) == 0 && ((mask.at<char>(k, l) & DEFECT) == 0)){
 
-								float val = filtered.at<float>(k, l);
+								float val = filtered.at(k, l);
 
 								float c1h, c1v, c2h, c2v, c3h, c3v, c4h, c4v;
 								float chpre, chpost, cvpre, cvpost;
@@ -736,7 +758,7 @@ namespace CradleFunctions{
 								}
 
 								ms.piece_mask.at<ushort>(k, l) = ms.pieces;
-								cradle.at<float>(k, l) = filtered.at<float>(k, l) - (whpre*chpre + whpost*chpost + wvpre*cvpre + wvpost*cvpost) *1.0 / (whpre + whpost + wvpre + wvpost);
+								cradle.at<float>(k, l) = filtered.at(k, l) - (whpre*chpre + whpost*chpost + wvpre*cvpre + wvpost*cvpost) *1.0 / (whpre + whpost + wvpre + wvpost);
 							}
 						}
 					}
@@ -754,6 +776,8 @@ namespace CradleFunctions{
 
 			}
 		}
+
+		smoothing.release();
 	}
 
 	//Remove vertical cradle pieces and save out correction model used for later usage
@@ -765,6 +789,21 @@ namespace CradleFunctions{
 		std::vector<int> s,									//Width of vertical cradle pieces
 		std::vector<std::vector<std::vector<float>>> &vm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
+	){
+		SmoothingCache smoothing(img);
+		removeVertical(img, mask, cradle, midpos_points, s, vm, ms, smoothing);
+	}
+
+	//Remove vertical cradle pieces and save out correction model used for later usage
+	void removeVertical(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked vertical and/or horizontal cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of vertical cradle pieces
+		std::vector<int> s,									//Width of vertical cradle pieces
+		std::vector<std::vector<std::vector<float>>> &vm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
+		MarkedSegments &ms,									//MarkedSegment structure will contain processing information
+		SmoothingCache &smoothing							//Smoothed image bands, shared with the other removal stages
 	){
 		//Set avg_s as a function of the average cradle-piece thickness
 		float avg = 0;
@@ -775,10 +814,8 @@ namespace CradleFunctions{
 		avg /= s.size();
 		avg_s = std::max(3, (int)(avg * 0.2));
 
-		//Directional smoothing of image
-		cv::Mat smooth, filtered;
-		smooth = cv::Mat(avg_s, 1, CV_32F, cv::Scalar(1.0 / avg_s));
-		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+		//Directional smoothing of image, only evaluated on the columns each member samples
+		SmoothedImage &filtered = smoothing.vertical(avg_s);
 
 		int vtot = midpos_points.size();	//Total number of vertical pieces
 		std::vector<std::vector<int>> midpos(vtot);
@@ -793,6 +830,9 @@ namespace CradleFunctions{
 			//Set adaptively value of s
 			int sfm = s[i] * 0.1;
 
+			//Only the lines around this piece are sampled; drop those of the previous one
+			filtered.release();
+
 			//Create midpos vector (interpolate two points for all columns)
 			midpos[i] = std::vector<int>(img.rows);
 			int x1 = midpos_points[i][0];
@@ -885,13 +925,13 @@ namespace CradleFunctions{
 						sample.ncu[j] = -1;
 						for (int z = std::max(0, p1 - 2 * sfm); z <= p1 - sfm; z++){
 							if ((mask.at<char>(j, z) & (H_MASK | DEFECT)) == 0){
-								medi[z - (p1 - 2 * sfm)] = filtered.at<float>(j, z);
+								medi[z - (p1 - 2 * sfm)] = filtered.at(j, z);
 							}
 						}
 						sample.ncu[j] = getMedian(medi);
 
 						if ((mask.at<char>(j, p1 + sfm) & (H_MASK | DEFECT)) == 0){
-							sample.cu[j] = filtered.at<float>(j, p1 + sfm);
+							sample.cu[j] = filtered.at(j, p1 + sfm);
 						}
 						else{
 							sample.cu[j] = -1;
@@ -905,13 +945,13 @@ namespace CradleFunctions{
 						sample.ncl[j] = -1;
 						for (int z = p2 + sfm; z < std::min(p2 + 2 * sfm, filtered.cols); z++){
 							if ((mask.at<char>(j, z) & (H_MASK | DEFECT)) == 0){
-								medi[z - p2 - sfm] = filtered.at<float>(j, z);
+								medi[z - p2 - sfm] = filtered.at(j, z);
 							}
 						}
 						sample.ncl[j] = getMedian(medi);
 
 						if ((mask.at<char>(j, p2 - sfm) & (H_MASK | DEFECT)) == 0){
-							sample.cl[j] = filtered.at<float>(j, p2 - sfm);
+							sample.cl[j] = filtered.at(j, p2 - sfm);
 						}
 						else{
 							sample.cl[j] = -1;
@@ -1127,7 +1167,7 @@ namespace CradleFunctions{
 					int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
 					for (int l = lpmin; l <= lpmax; l++){
 						if ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0){
-							edgemap[mid - l + sfm] += filtered.at<float>(j, l);
+							edgemap[mid - l + sfm] += filtered.at(j, l);
 							cnt[mid - l + sfm]++;
 						}
 					}
@@ -1179,7 +1219,7 @@ namespace CradleFunctions{
 							for (int l = lpmin; l < lpmax; l++){
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(j, l);
+									samplemean += filtered.at(j, l);
 									edgemean += edgemap[pos];
 									c++;
 								}
@@ -1193,7 +1233,7 @@ namespace CradleFunctions{
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size()){
 									if (edgemap[pos] != 0 && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
+										float tmp = (edgemap[pos] - edgemean) - (filtered.at(j, l) - samplemean);
 										cost += tmp*tmp;
 									}
 								}
@@ -1211,8 +1251,8 @@ namespace CradleFunctions{
 						int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.cols - 1);
 						int mid = p1v[j - sample.start];
 
-						float ref = lin_model_midu[1] * filtered.at<float>(j, lpmax) + lin_model_midu[0];
-						float dif = filtered.at<float>(j, lpmax) - ref;
+						float ref = lin_model_midu[1] * filtered.at(j, lpmax) + lin_model_midu[0];
+						float dif = filtered.at(j, lpmax) - ref;
 
 						float a, b;
 						//Check if the edge is dropping or is just flat cradle
@@ -1250,7 +1290,7 @@ namespace CradleFunctions{
 					int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
 					for (int l = lpmin; l <= lpmax; l++){
 						if ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0){
-							edgemap[mid - l + sfm] += filtered.at<float>(j, l);
+							edgemap[mid - l + sfm] += filtered.at(j, l);
 							cnt[mid - l + sfm]++;
 						}
 					}
@@ -1301,7 +1341,7 @@ namespace CradleFunctions{
 							for (int l = lpmin; l < lpmax; l++){
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(j, l);
+									samplemean += filtered.at(j, l);
 									edgemean += edgemap[pos];
 									c++;
 								}
@@ -1315,7 +1355,7 @@ namespace CradleFunctions{
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(j, l) & (H_MASK | DEFECT)) == 0)){
 									if (edgemap[pos] != 0){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(j, l) - samplemean);
+										float tmp = (edgemap[pos] - edgemean) - (filtered.at(j, l) - samplemean);
 										cost += tmp*tmp;
 									}
 								}
@@ -1333,8 +1373,8 @@ namespace CradleFunctions{
 						int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.cols - 1);
 						int mid = p2v[j - sample.start];
 
-						float ref = lin_model_midl[1] * filtered.at<float>(j, lpmin) + lin_model_midl[0];// filtered.at<float>(lpmax, j);
-						float dif = filtered.at<float>(j, lpmin) - ref;
+						float ref = lin_model_midl[1] * filtered.at(j, lpmin) + lin_model_midl[0];// filtered.at(lpmax, j);
+						float dif = filtered.at(j, lpmin) - ref;
 						float a, b;
 
 						//Check if the edge is dropping or is just flat cradle
@@ -1362,6 +1402,8 @@ namespace CradleFunctions{
 				}
 			}
 		}
+
+		smoothing.release();
 	}
 	
 	//Remove horizontal cradle pieces and save out correction model used for later usage
@@ -1374,6 +1416,21 @@ namespace CradleFunctions{
 		std::vector<std::vector<std::vector<float>>> &hm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
 		MarkedSegments &ms									//MarkedSegment structure will contain processing information
 	){
+		SmoothingCache smoothing(img);
+		removeHorizontal(img, mask, cradle, midpos_points, s, hm, ms, smoothing);
+	}
+
+	//Remove horizontal cradle pieces and save out correction model used for later usage
+	void removeHorizontal(
+		const cv::Mat &img,									//Input grayscale float X-ray image
+		cv::Mat &mask,										//Mask containing marked horizontal and/or vertical cradle positions
+		cv::Mat &cradle,									//Cradle component after separation saved out here
+		std::vector<std::vector<int>> &midpos_points,		//Center of horizontal cradle pieces
+		std::vector<int> s,									//Width of horizontal cradle pieces
+		std::vector<std::vector<std::vector<float>>> &hm,	//Saves out parameters of the fitted multiplicative model, used for processing cross-sections
+		MarkedSegments &ms,									//MarkedSegment structure will contain processing information
+		SmoothingCache &smoothing							//Smoothed image bands, shared with the other removal stages
+	){
 
 		//Set avg_s as a function of the average cradle-piece thickness
 		float avg = 0;
@@ -1384,10 +1441,8 @@ namespace CradleFunctions{
 		avg /= s.size();
 		avg_s = std::max(3, (int)(avg * 0.2));
 
-		//Directional smoothing of image
-		cv::Mat smooth, filtered;
-		smooth = cv::Mat(1, avg_s, CV_32F, cv::Scalar(1.0 / avg_s));
-		cv::filter2D(img, filtered, CV_32F, smooth, cv::Point(-1, -1), 0, cv::BORDER_DEFAULT);
+		//Directional smoothing of image, only evaluated on the rows each member samples
+		SmoothedImage &filtered = smoothing.horizontal(avg_s);
 
 		int vtot = midpos_points.size();	//Total number of horizontal pieces
 		std::vector<std::vector<int>> midpos(vtot);
@@ -1402,6 +1457,9 @@ namespace CradleFunctions{
 			//Set adaptively value of s
 			int sfm = s[i] * 0.1;
 
+			//Only the lines around this piece are sampled; drop those of the previous one
+			filtered.release();
+
 			//Create midpos vector (interpolate two points for all columns)
 			midpos[i] = std::vector<int>(img.cols);
 			int x1 = midpos_points[i][0];
@@ -1487,13 +1545,13 @@ namespace CradleFunctions{
 						sample.ncu[j] = -1;
 						for (int z = std::max(0, p1 - 2 * sfm); z <= p1 - sfm; z++){
 							if ((mask.at<char>(z, j) & (V_MASK | DEFECT)) == 0){
-								medi[z - (p1 - 2 * sfm)] = filtered.at<float>(z, j);
+								medi[z - (p1 - 2 * sfm)] = filtered.at(z, j);
 							}
 						}
 						sample.ncu[j] = getMedian(medi);
 
 						if ((mask.at<char>(p1 + sfm, j) & (V_MASK | DEFECT)) == 0){
-							sample.cu[j] = filtered.at<float>(p1 + sfm, j);
+							sample.cu[j] = filtered.at(p1 + sfm, j);
 						}
 						else{
 							sample.cu[j] = -1;
@@ -1507,13 +1565,13 @@ namespace CradleFunctions{
 						sample.ncl[j] = -1;
 						for (int z = p2 + sfm; z < std::min(p2 + 2 * sfm, filtered.rows); z++){
 							if ((mask.at<char>(z, j) & (V_MASK | DEFECT)) == 0){
-								medi[z - p2 - sfm] = filtered.at<float>(z, j);
+								medi[z - p2 - sfm] = filtered.at(z, j);
 							}
 						}
 						sample.ncl[j] = getMedian(medi);
 
 						if ((mask.at<char>(p2 - sfm, j) & (V_MASK | DEFECT)) == 0){
-							sample.cl[j] = filtered.at<float>(p2 - sfm, j);
+							sample.cl[j] = filtered.at(p2 - sfm, j);
 						}
 						else{
 							sample.cl[j] = -1;
@@ -1724,7 +1782,7 @@ namespace CradleFunctions{
 					int lpmax = std::min(p1v[j - sample.start] + sfm, filtered.rows - 1);
 					for (int l = lpmin; l <= lpmax; l++){
 						if ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0){
-							edgesample[mid - l + sfm][j - sample.start] = filtered.at<float>(l, j);
+							edgesample[mid - l + sfm][j - sample.start] = filtered.at(l, j);
 							cnt[mid - l + sfm]++;
 						}
 					}
@@ -1778,7 +1836,7 @@ namespace CradleFunctions{
 							for (int l = lpmin; l < lpmax; l++){
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(l, j);
+									samplemean += filtered.at(l, j);
 									edgemean += edgemap[pos];
 									c++;
 								}
@@ -1792,7 +1850,7 @@ namespace CradleFunctions{
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
 									if (cnt[pos] != 0){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(l, j) - samplemean);
+										float tmp = (edgemap[pos] - edgemean) - (filtered.at(l, j) - samplemean);
 										cost += tmp*tmp;
 									}
 								}
@@ -1810,8 +1868,8 @@ namespace CradleFunctions{
 						lpmax = std::min(p1v[j - sample.start] + sfm, filtered.rows - 1);
 						mid = p1v[j - sample.start];
 
-						float ref = lin_model_midu[1] * filtered.at<float>(lpmax, j) + lin_model_midu[0];
-						float dif = filtered.at<float>(lpmax, j) - ref;
+						float ref = lin_model_midu[1] * filtered.at(lpmax, j) + lin_model_midu[0];
+						float dif = filtered.at(lpmax, j) - ref;
 
 						float a, b;
 						//Check if the edge is dropping or is just flat cradle
@@ -1849,7 +1907,7 @@ namespace CradleFunctions{
 					int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.rows - 1);
 					for (int l = lpmin; l <= lpmax; l++){
 						if ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0){
-							edgemap[mid - l + sfm] += filtered.at<float>(l, j);
+							edgemap[mid - l + sfm] += filtered.at(l, j);
 							cnt[mid - l + sfm]++;
 						}
 					}
@@ -1900,7 +1958,7 @@ namespace CradleFunctions{
 							for (int l = lpmin; l < lpmax; l++){
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
-									samplemean += filtered.at<float>(l, j);
+									samplemean += filtered.at(l, j);
 									edgemean += edgemap[pos];
 									c++;
 								}
@@ -1914,7 +1972,7 @@ namespace CradleFunctions{
 								int pos = mid - l + sfm + k;
 								if (pos >= 0 && pos < edgemap.size() && ((mask.at<char>(l, j) & (V_MASK | DEFECT)) == 0)){
 									if (edgemap[pos] != 0){
-										float tmp = (edgemap[pos] - edgemean) - (filtered.at<float>(l, j) - samplemean);
+										float tmp = (edgemap[pos] - edgemean) - (filtered.at(l, j) - samplemean);
 										cost += tmp*tmp;
 									}
 								}
@@ -1932,8 +1990,8 @@ namespace CradleFunctions{
 						int lpmax = std::min(p2v[j - sample.start] + sfm, filtered.rows - 1);
 						int mid = p2v[j - sample.start];
 
-						float ref = lin_model_midl[1] * filtered.at<float>(lpmin, j) + lin_model_midl[0]; //filtered.at<float>(lpmax, j);
-						float dif = filtered.at<float>(lpmin, j) - ref;
+						float ref = lin_model_midl[1] * filtered.at(lpmin, j) + lin_model_midl[0]; //filtered.at(lpmax, j);
+						float dif = filtered.at(lpmin, j) - ref;
 						float a, b;
 
 						//Check if the edge is dropping or is just flat cradle
@@ -1961,6 +2019,8 @@ namespace CradleFunctions{
 				}
 			}
 		}
+
+		smoothing.release();
 	}
 
 	//Recursive watershed algorithm that marks all pixels of image 'val' smaller then threshold th,
@@ -3457,6 +3517,27 @@ namespace CradleFunctions{
 		return var / cnt;
 	}
 
+	//Fill the segment -> cradle piece tables of 'ms' from pieceIDh/pieceIDv.
+	//Should a segment be listed under several pieces of one direction, the last one wins.
+	void buildPieceLookup(MarkedSegments &ms){
+		int size = ms.pieces + 1;
+		for (auto &ids : ms.pieceIDh)
+			for (int id : ids)
+				size = std::max(size, id + 1);
+		for (auto &ids : ms.pieceIDv)
+			for (int id : ids)
+				size = std::max(size, id + 1);
+
+		ms.piece_h.assign(size, -1);
+		ms.piece_v.assign(size, -1);
+		for (int i = 0; i < ms.pieceIDh.size(); i++)
+			for (int id : ms.pieceIDh[i])
+				ms.piece_h[id] = i;
+		for (int i = 0; i < ms.pieceIDv.size(); i++)
+			for (int id : ms.pieceIDv[i])
+				ms.piece_v[id] = i;
+	}
+
 	//Save out MarkedSegments structure 'ms' to a file 'name'
 	void writeMarkedSegmentsFile(std::string name, MarkedSegments ms){
 		std::ofstream output(name.c_str());
@@ -3576,9 +3657,241 @@ namespace CradleFunctions{
 			}
 		}
 		infile.close();
+		buildPieceLookup(ms);
 		return ms;
 	}
 
+	//Statistics of the cradle removed intensity (in - cradle, clipped to [0, 255]) of every segment in piece_mask.
+	//Element i of the result describes the pixels marked i; element 0 covers pixels outside any segment.
+	//A single pass over the image fills one 256-bin histogram per segment, in parallel over row bands.
+	std::vector<piece_statistics> pieceStatistics(const cv::Mat &in, const cv::Mat &cradle, const cv::Mat &piece_mask, int pieces){
+		CV_Assert(in.type() == CV_32F && cradle.type() == CV_32F && piece_mask.type() == CV_16U);
+
+		std::vector<int> hist((pieces + 1) * 256);
+		std::mutex hist_lock;
+
+		cv::parallel_for_(cv::Range(0, piece_mask.rows), [&](const cv::Range &range){
+			std::vector<int> local((pieces + 1) * 256);
+			for (int i = range.start; i < range.end; i++){
+				const float *srow = in.ptr<float>(i);
+				const float *crow = cradle.ptr<float>(i);
+				const ushort *mrow = piece_mask.ptr<ushort>(i);
+				for (int j = 0; j < piece_mask.cols; j++){
+					if (mrow[j] > pieces)
+						continue;
+					int v = srow[j] - crow[j];
+					v = v < 0 ? 0 : v > 255 ? 255 : v;
+					local[mrow[j] * 256 + v]++;
+				}
+			}
+
+			std::lock_guard<std::mutex> guard(hist_lock);
+			for (size_t k = 0; k < hist.size(); k++){
+				hist[k] += local[k];
+			}
+		}, std::max(1, cv::getNumThreads()));
+
+		std::vector<piece_statistics> res(pieces + 1);
+		for (int i = 0; i <= pieces; i++){
+			const int *h = &hist[i * 256];
+			piece_statistics &st = res[i];
+			st.count = 0;
+			st.median = st.min = st.max = 0;
+			for (int v = 0; v < 256; v++){
+				st.count += h[v];
+			}
+			if (st.count == 0)
+				continue;
+
+			//Element count / 2 of the sorted values (the upper middle for even counts)
+			int half = st.count / 2, seen = 0;
+			st.min = 255;
+			for (int v = 0; v < 256; v++){
+				if (h[v] == 0)
+					continue;
+				if (v < st.min)
+					st.min = v;
+				st.max = v;
+				if (seen <= half && seen + h[v] > half)
+					st.median = v;
+				seen += h[v];
+			}
+		}
+		return res;
+	}
+
+	//Outer boundaries of every segment in piece_mask, one outline per connected region.
+	//A first pass collects the bounding box of each segment; contours are then traced only
+	//inside those boxes, so the total work stays proportional to the image size.
+	std::vector<piece_outline> pieceOutlines(const cv::Mat &piece_mask, int pieces){
+		CV_Assert(piece_mask.type() == CV_16U);
+
+		std::vector<cv::Point> tl(pieces + 1, cv::Point(piece_mask.cols, piece_mask.rows));
+		std::vector<cv::Point> br(pieces + 1, cv::Point(-1, -1));
+		for (int i = 0; i < piece_mask.rows; i++){
+			const ushort *mrow = piece_mask.ptr<ushort>(i);
+			for (int j = 0; j < piece_mask.cols; j++){
+				int id = mrow[j];
+				if (id == 0 || id > pieces)
+					continue;
+				tl[id].x = std::min(tl[id].x, j);
+				tl[id].y = std::min(tl[id].y, i);
+				br[id].x = std::max(br[id].x, j);
+				br[id].y = std::max(br[id].y, i);
+			}
+		}
+
+		std::vector<piece_outline> res;
+		for (int id = 1; id <= pieces; id++){
+			if (br[id].x < 0)
+				continue;
+
+			//One pixel of padding keeps regions touching the box edge closed
+			cv::Rect box(tl[id], br[id] + cv::Point(1, 1));
+			cv::Mat region(box.height + 2, box.width + 2, CV_8U, cv::Scalar(0));
+			cv::compare(piece_mask(box), id, region(cv::Rect(1, 1, box.width, box.height)), cv::CMP_EQ);
+
+			//One outline per connected region, top to bottom then left to right. Regions too thin to
+			//enclose anything (a pixel, a pixel-wide line) have fewer than three corners and are skipped.
+			std::vector<std::vector<cv::Point>> contours;
+			cv::findContours(region, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE, box.tl() - cv::Point(1, 1));
+			std::vector<std::pair<cv::Point, size_t>> order;
+			for (size_t c = 0; c < contours.size(); c++){
+				cv::Rect r = cv::boundingRect(contours[c]);
+				if (contours[c].size() >= 3)
+					order.emplace_back(cv::Point(r.x, r.y), c);
+			}
+			std::sort(order.begin(), order.end(), [](const std::pair<cv::Point, size_t> &a, const std::pair<cv::Point, size_t> &b){
+				return a.first.y != b.first.y ? a.first.y < b.first.y : a.first.x < b.first.x;
+			});
+			for (const auto &c : order){
+				piece_outline o;
+				o.piece = id;
+				o.points.swap(contours[c.second]);
+				res.push_back(std::move(o));
+			}
+		}
+		return res;
+	}
+
+	/**
+	 * Lazily evaluated running-mean smoothing, used by the removal stages in place of
+	 * full-image cv::filter2D calls. Borders are handled as cv::BORDER_DEFAULT.
+	 **/
+	SmoothedImage::SmoothedImage(const cv::Mat &img, int ksize, int axis) :
+		rows(img.rows), cols(img.cols), img(img), ksize(ksize), axis(axis){
+		CV_Assert(img.type() == CV_32F && ksize > 0);
+		if (axis == CROSS_DIR)
+			rowsource.reset(new SmoothedImage(img, ksize, HORIZONTAL_DIR));
+		setBand(cv::Rect(0, 0, cols, rows));
+	}
+
+	float SmoothedImage::at(int r, int c){
+		CV_DbgAssert(band.contains(cv::Point(c, r)));
+		if (axis == VERTICAL_DIR)
+			return line(c)[r - band.y];
+		return line(r)[c - band.x];
+	}
+
+	void SmoothedImage::setBand(const cv::Rect &b){
+		band = b & cv::Rect(0, 0, cols, rows);
+		if (rowsource){
+			//The box averages the rows up to ksize above and below (reflected at the image border)
+			rowsource->setBand(cv::Rect(band.x, band.y - ksize, band.width, band.height + 2 * ksize));
+		}
+		release();
+	}
+
+	void SmoothedImage::release(){
+		std::vector<std::vector<float>>(axis == VERTICAL_DIR ? cols : rows).swap(lines);
+		if (rowsource)
+			rowsource->release();
+	}
+
+	const std::vector<float> &SmoothedImage::line(int index){
+		std::vector<float> &res = lines[index];
+		if (!res.empty())
+			return res;
+
+		int anchor = ksize / 2;
+
+		if (axis == CROSS_DIR){
+			//Average ksize horizontally smoothed rows
+			std::vector<float> sum(band.width);
+			for (int k = 0; k < ksize; k++){
+				const std::vector<float> &src = rowsource->line(cv::borderInterpolate(index - anchor + k, rows, cv::BORDER_DEFAULT));
+				for (int j = 0; j < band.width; j++){
+					sum[j] += src[j];
+				}
+			}
+			for (int j = 0; j < band.width; j++){
+				sum[j] /= ksize;
+			}
+			res = sum;
+			return res;
+		}
+
+		//Gather the source line over the band and the kernel reach around it
+		int n = axis == VERTICAL_DIR ? rows : cols;
+		int first = axis == VERTICAL_DIR ? band.y : band.x;
+		int length = axis == VERTICAL_DIR ? band.height : band.width;
+		int lo = std::max(0, first - ksize);
+		int hi = std::min(n, first + length + ksize);
+		std::vector<float> src(hi - lo);
+		if (axis == VERTICAL_DIR){
+			for (int i = lo; i < hi; i++){
+				src[i - lo] = img.at<float>(i, index);
+			}
+		}
+		else{
+			const float *row = img.ptr<float>(index);
+			std::copy(row + lo, row + hi, src.begin());
+		}
+		auto value = [&](int i){ return src[cv::borderInterpolate(i, n, cv::BORDER_DEFAULT) - lo]; };
+
+		//Running sum over the window [i - anchor, i - anchor + ksize)
+		res = std::vector<float>(length);
+		if (length == 0)
+			return res;
+		double sum = 0;
+		for (int k = 0; k < ksize; k++){
+			sum += value(first + k - anchor);
+		}
+		res[0] = sum / ksize;
+		for (int i = 1; i < length; i++){
+			sum += value(first + i - anchor + ksize - 1);
+			sum -= value(first + i - anchor - 1);
+			res[i] = sum / ksize;
+		}
+		return res;
+	}
+
+	SmoothingCache::SmoothingCache(const cv::Mat &img) : img(img){
+	}
+
+	SmoothedImage &SmoothingCache::vertical(int ksize){
+		return get(ksize, VERTICAL_DIR);
+	}
+
+	SmoothedImage &SmoothingCache::horizontal(int ksize){
+		return get(ksize, HORIZONTAL_DIR);
+	}
+
+	SmoothedImage &SmoothingCache::box(int ksize){
+		return get(ksize, CROSS_DIR);
+	}
+
+	void SmoothingCache::release(){
+		images.clear();
+	}
+
+	SmoothedImage &SmoothingCache::get(int ksize, int axis){
+		std::unique_ptr<SmoothedImage> &res = images[std::make_pair(ksize, axis)];
+		if (!res)
+			res.reset(new SmoothedImage(img, ksize, axis));
+		return *res;
+	}
+
 	/**
 	 * Interface callback functions, used to give feedback on progress during execution
 	 **/
@@ -3596,4 +3909,11 @@ namespace CradleFunctions{
 			return s_callbacks->progress(value, total);
 		return true;
 	}
+
+	bool region(const cv::Rect &rect, const cv::Mat &pixels)
+	{
+		if (s_callbacks)
+			return s_callbacks->region(rect, pixels);
+		return true;
+	}
 }
@@ -42,15 +42,15 @@ namespace MCA{
 
 
 	//Separate image 'in' into a texture and cartoon part using the dictionaries specified in dict
-	void MCA_Bcr(cv::Mat &in, std::vector<int> &dict, cv::Mat &texture, cv::Mat &cartoon){
+	void MCA_Bcr(cv::Mat &in, std::vector<int> &dict, cv::Mat &texture, cv::Mat &cartoon, int n){
 
 		// Initializations
-		int N, M, n, max;
+		int N, M, max;
 		N = in.rows;
 		M = in.cols;
+		CV_Assert(N <= n && M <= n);
 		
-		//Pad input to 512 block size
-		n = 512;
+		//Pad input to n x n block size
 		cv::Mat lin(n, n, CV_32F, cv::Scalar(0));
 		for (int i = 0; i < N; i++){
 			for (int j = 0; j < M; j++){
@@ -207,7 +207,7 @@ namespace MCA{
 
 			//Decomposition
 			std::vector<std::vector<cv::Mat>> dst;
-			dst = FDCT::fdct_wrapping(in, 7);
+			dst = FDCT::fdct_wrapping(in, curveletScales(in.rows));
 
 			//Iterate though all coefficients
 			for (int j1 = 0; j1 < dst.size(); j1++){
@@ -312,6 +312,11 @@ namespace MCA{
 		return out;
 	}
 
+	//Number of curvelet scales for an n x n image: 7 at 512, one less per halving of the size
+	int curveletScales(int n){
+		return std::max(2, int(std::round(std::log2(n))) - 2);
+	}
+
 	void calculateL2Norm(int n, std::vector<int> &dict, std::vector<std::vector<std::vector<float>>> &norm){
 		//Array of pointer to normalization structure
 		(norm) = std::vector<std::vector<std::vector<float>>>((dict).size());
@@ -326,7 +331,7 @@ namespace MCA{
 
 				//Decomposition
 				std::vector<std::vector<cv::Mat>> dst;
-				dst = FDCT::fdct_wrapping(dirac, 7);
+				dst = FDCT::fdct_wrapping(dirac, curveletScales(n));
 
 				//Normalize
 				norm[i] = std::vector<std::vector<float>>((dst).size());
@@ -412,7 +417,7 @@ namespace MCA{
 
 				//Decomposition
 				std::vector<std::vector<cv::Mat>> dst;
-				dst = FDCT::fdct_wrapping(in, 7);
+				dst = FDCT::fdct_wrapping(in, curveletScales(in.rows));
 
 				//Iterate though all coefficients - SKIP OVER LOWEST LEVEL
 				for (int j1 = 1; j1 < dst.size(); j1++){
@@ -15,9 +15,28 @@
 #include <platypus/CradleFunctions.h>
 #include <platypus/MCA.h>
 #include <platypus/FFST.h>
-#include <opencv2/flann.hpp>
-#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
 #include <random>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 #define PI 3.1415927
 
@@ -29,8 +48,7 @@
 
 namespace TextureRemoval{
 
-	const int block_size = 512;		//Image block size for processing wood-grain separation
-	const int overlap = 48;			//Amount of overlap between neighboring blocks
+	const int transform_size = 512;	//Size of the tabulated FFST filter bank; other block sizes resample it
 	const int SEED = 1;				//Constant seed for random number generators (to guarantee reproductibility)
 	const int SN = 4;				//Sub-sampling factor for rows
 	const int SM = 4;				//Sub-sampling factor for columns
@@ -38,6 +56,11 @@ namespace TextureRemoval{
 	const int PSM = 9;				//Sub-sampling factor for columns for clustering
 	const int NR_NEIGHBOURS = 5;	//Nr neighbors for Nearest-neighbour (NN) search	
 	const int max_samples = 10000;	//Maximum number of samples to be processed for the post-inference algo
+	const int max_noncradle_blocks = 8;	//Blocks without cradle that are decomposed for non-cradle statistics
+
+	//Keys of the counter-based generators (see PhiloxEngine): training set selection and Gibbs sampling
+	const uint64_t sample_key = SEED;
+	const uint64_t gibbs_key = (uint64_t(1) << 32) | SEED;
 
 	namespace {
 	Status maxStatus(Status lhs, Status rhs) {
@@ -47,6 +70,401 @@ namespace TextureRemoval{
 	void promoteStatus(Status &current, Status candidate) {
 		current = maxStatus(current, candidate);
 	}
+
+	//Rows 'rows' of 'src', in that order
+	void gatherRows(const cv::Mat &src, const std::vector<int> &rows, cv::Mat &dst){
+		dst.create(int(rows.size()), src.cols, src.type());
+		for (int r = 0; r < rows.size(); r++)
+			std::memcpy(dst.ptr(r), src.ptr(rows[r]), src.cols * src.elemSize());
+	}
+
+	//Installed memory in bytes, 0 if unknown
+	size_t physicalMemoryBytes(){
+#ifdef _WIN32
+		MEMORYSTATUSEX status;
+		status.dwLength = sizeof(status);
+		return GlobalMemoryStatusEx(&status) ? size_t(status.ullTotalPhys) : 0;
+#else
+		long pages = sysconf(_SC_PHYS_PAGES);
+		long page_size = sysconf(_SC_PAGE_SIZE);
+		return pages > 0 && page_size > 0 ? size_t(pages) * size_t(page_size) : 0;
+#endif
+	}
+
+	//Rectangle 'r' of the image 'src' padded by 'pad' pixels on every side (BORDER_REFLECT), without
+	//padding the whole image: the border is taken from the pixels around the region where they exist
+	void paddedRegion(const cv::Mat &src, int pad, const cv::Rect &r, cv::Mat &dst){
+		cv::Rect shifted = r - cv::Point(pad, pad);
+		cv::Rect inside = shifted & cv::Rect(0, 0, src.cols, src.rows);
+		cv::copyMakeBorder(src(inside), dst, inside.y - shifted.y, shifted.br().y - inside.br().y,
+			inside.x - shifted.x, shifted.br().x - inside.br().x, cv::BORDER_REFLECT);
+	}
+
+	//Float image kept in square tiles, zero until written. Least recently used tiles beyond the memory
+	//budget are written to a spill file (one slot per tile) and read back on demand; without a spill
+	//directory every tile stays in memory.
+	class TileStore{
+	public:
+		TileStore(int rows, int cols, size_t max_bytes, const std::string &spill_dir);
+		~TileStore();
+
+		//Copy rectangle 'r' of the image into 'dst', or 'src' into rectangle 'r'
+		void read(const cv::Rect &r, cv::Mat &dst);
+		void write(const cv::Rect &r, const cv::Mat &src);
+
+	private:
+		static const int tile_size = 256;
+
+		cv::Mat &tile(int t);
+		void evict();
+
+		int tiles_x, tiles_y;
+		size_t max_bytes, bytes;
+		std::mutex lock;
+		std::list<int> lru;			//Resident tiles, most recently used first
+		std::map<int, std::pair<cv::Mat, std::list<int>::iterator>> resident;
+		std::vector<bool> spilled;
+		std::string path;
+		std::fstream file;
+	};
+
+	TileStore::TileStore(int rows, int cols, size_t max_bytes, const std::string &spill_dir)
+		: tiles_x((cols + tile_size - 1) / tile_size), tiles_y((rows + tile_size - 1) / tile_size),
+		max_bytes(max_bytes), bytes(0), spilled(tiles_x * tiles_y){
+		if (!spill_dir.empty()){
+			path = spill_dir + "/platypus_texture_" + std::to_string(std::random_device()()) + ".bin";
+			file.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!file)
+				path.clear();
+		}
+	}
+
+	TileStore::~TileStore(){
+		if (!path.empty()){
+			file.close();
+			std::remove(path.c_str());
+		}
+	}
+
+	void TileStore::read(const cv::Rect &r, cv::Mat &dst){
+		dst.create(r.height, r.width, CV_32F);
+		std::lock_guard<std::mutex> guard(lock);
+		for (int ty = r.y / tile_size; ty * tile_size < r.br().y; ty++){
+			for (int tx = r.x / tile_size; tx * tile_size < r.br().x; tx++){
+				cv::Rect area(tx * tile_size, ty * tile_size, tile_size, tile_size);
+				cv::Rect part = r & area;
+				tile(ty * tiles_x + tx)(part - area.tl()).copyTo(dst(part - r.tl()));
+			}
+		}
+	}
+
+	void TileStore::write(const cv::Rect &r, const cv::Mat &src){
+		std::lock_guard<std::mutex> guard(lock);
+		for (int ty = r.y / tile_size; ty * tile_size < r.br().y; ty++){
+			for (int tx = r.x / tile_size; tx * tile_size < r.br().x; tx++){
+				cv::Rect area(tx * tile_size, ty * tile_size, tile_size, tile_size);
+				cv::Rect part = r & area;
+				src(part - r.tl()).copyTo(tile(ty * tiles_x + tx)(part - area.tl()));
+			}
+		}
+	}
+
+	//Resident tile t, read back or created as needed. Called with the lock held; the returned
+	//tile is the most recently used one, so the eviction it triggers never drops it.
+	cv::Mat &TileStore::tile(int t){
+		auto it = resident.find(t);
+		if (it != resident.end()){
+			lru.splice(lru.begin(), lru, it->second.second);
+			return it->second.first;
+		}
+
+		cv::Mat data(tile_size, tile_size, CV_32F, cv::Scalar(0));
+		if (spilled[t]){
+			file.seekg(std::streamoff(t) * data.total() * sizeof(float));
+			file.read((char *)data.ptr<float>(), data.total() * sizeof(float));
+		}
+		lru.push_front(t);
+		cv::Mat &res = resident[t].first;
+		res = data;
+		resident[t].second = lru.begin();
+		bytes += data.total() * sizeof(float);
+		evict();
+		return res;
+	}
+
+	void TileStore::evict(){
+		while (bytes > max_bytes && lru.size() > 1 && !path.empty()){
+			int t = lru.back();
+			auto it = resident.find(t);
+			const cv::Mat &data = it->second.first;
+			file.seekp(std::streamoff(t) * data.total() * sizeof(float));
+			file.write((const char *)data.ptr<float>(), data.total() * sizeof(float));
+			spilled[t] = true;
+
+			bytes -= data.total() * sizeof(float);
+			lru.pop_back();
+			resident.erase(it);
+		}
+	}
+
+	//Forward shearlet coefficients of the processing blocks. A block is transformed once and reused
+	//until the texture under it changes; least recently used blocks beyond the memory budget are
+	//spilled to disk, or dropped and recomputed when no spill directory is set.
+	class CoefficientCache{
+	public:
+		//Blocks are zero-padded to 'size' x 'size'. Only 'subbands' are computed for blocks that are not flagged
+		//in 'reconstructed'. Beyond 'max_bytes', blocks are spilled to 'spill_dir' (dropped if empty).
+		CoefficientCache(TileStore &texture, const std::vector<std::vector<int>> &coords, int size,
+			const std::vector<bool> &subbands, const std::vector<bool> &reconstructed, size_t max_bytes, const std::string &spill_dir);
+		~CoefficientCache();
+
+		//Coefficients of block z, shared with the cache (clone before modifying)
+		std::vector<cv::Mat> get(int z);
+
+		//Forget block z after the texture it covers was rewritten
+		void invalidate(int z);
+
+	private:
+		std::vector<cv::Mat> transform(int z);
+		std::string spillPath(int z) const;
+		void evict();
+
+		TileStore &texture;
+		const std::vector<std::vector<int>> &coords;
+		int size;
+		std::vector<bool> subbands, reconstructed;
+		std::mutex lock;
+		std::list<int> lru;			//Resident blocks, most recently used first
+		std::map<int, std::pair<std::vector<cv::Mat>, std::list<int>::iterator>> resident;
+		std::vector<bool> spilled;
+		size_t bytes, max_bytes;
+		std::string prefix;
+	};
+
+	CoefficientCache::CoefficientCache(TileStore &texture, const std::vector<std::vector<int>> &coords, int size,
+		const std::vector<bool> &subbands, const std::vector<bool> &reconstructed, size_t max_bytes, const std::string &spill_dir)
+		: texture(texture), coords(coords), size(size), subbands(subbands), reconstructed(reconstructed), spilled(coords.size()), bytes(0), max_bytes(max_bytes){
+		//Random tag keeps concurrent runs sharing a spill directory apart
+		std::error_code error;
+		if (!spill_dir.empty() && (std::filesystem::create_directories(spill_dir, error) || !error))
+			prefix = spill_dir + "/platypus_shearlet_" + std::to_string(std::random_device()()) + "_";
+	}
+
+	CoefficientCache::~CoefficientCache(){
+		for (int z = 0; z < spilled.size(); z++){
+			if (spilled[z])
+				std::remove(spillPath(z).c_str());
+		}
+	}
+
+	std::vector<cv::Mat> CoefficientCache::get(int z){
+		bool on_disk;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto it = resident.find(z);
+			if (it != resident.end()){
+				lru.splice(lru.begin(), lru, it->second.second);
+				return it->second.first;
+			}
+			on_disk = spilled[z];
+		}
+
+		//Read back spilled coefficients, or run the transform
+		std::vector<cv::Mat> coeffs;
+		if (on_disk){
+			std::ifstream file(spillPath(z), std::ios::binary);
+			int count = 0;
+			file.read((char *)&count, sizeof(int));
+			coeffs = std::vector<cv::Mat>(count);
+			for (int l = 0; l < count && file; l++){
+				int rows = 0, cols = 0;
+				file.read((char *)&rows, sizeof(int));
+				file.read((char *)&cols, sizeof(int));
+				coeffs[l].create(rows, cols, CV_32F);
+				file.read((char *)coeffs[l].ptr<float>(), rows * cols * sizeof(float));
+			}
+			if (!file)
+				coeffs.clear();
+		}
+		if (coeffs.empty())
+			coeffs = transform(z);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (resident.find(z) == resident.end()){
+			lru.push_front(z);
+			resident[z] = std::make_pair(coeffs, lru.begin());
+			for (auto &c : coeffs)
+				bytes += c.total() * c.elemSize();
+			evict();
+		}
+		return coeffs;
+	}
+
+	void CoefficientCache::invalidate(int z){
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = resident.find(z);
+		if (it != resident.end()){
+			for (auto &c : it->second.first)
+				bytes -= c.total() * c.elemSize();
+			lru.erase(it->second.second);
+			resident.erase(it);
+		}
+		if (spilled[z]){
+			std::remove(spillPath(z).c_str());
+			spilled[z] = false;
+		}
+	}
+
+	std::vector<cv::Mat> CoefficientCache::transform(int z){
+		int sx = coords[z][0];
+		int sy = coords[z][1];
+		int ex = coords[z][2];
+		int ey = coords[z][3];
+
+		//Block to work on
+		cv::Mat selection = cv::Mat(size, size, CV_32F, cv::Scalar(0));
+		cv::Mat region = selection(cv::Rect(0, 0, ey - sy, ex - sx));
+		texture.read(cv::Rect(sy, sx, ey - sy, ex - sx), region);
+
+		//Blocks that are only sampled never read the other subbands
+		return shearletTransform(selection, reconstructed[z] ? std::vector<bool>() : subbands);
+	}
+
+	std::string CoefficientCache::spillPath(int z) const{
+		return prefix + std::to_string(z) + ".bin";
+	}
+
+	//Called with the lock held
+	void CoefficientCache::evict(){
+		while (bytes > max_bytes && !lru.empty()){
+			int z = lru.back();
+			auto it = resident.find(z);
+			std::vector<cv::Mat> &coeffs = it->second.first;
+
+			//Coefficients do not change while resident, so a block is written at most once. Planes are
+			//written raw: the float coefficients of a textured block are mostly mantissa noise and barely
+			//compress losslessly, and reading them back is already cheaper than transforming the block again.
+			if (!prefix.empty() && !spilled[z]){
+				std::ofstream file(spillPath(z), std::ios::binary);
+				int count = coeffs.size();
+				file.write((const char *)&count, sizeof(int));
+				for (auto &c : coeffs){
+					cv::Mat data = c.isContinuous() ? c : c.clone();
+					file.write((const char *)&data.rows, sizeof(int));
+					file.write((const char *)&data.cols, sizeof(int));
+					file.write((const char *)data.ptr<float>(), data.total() * sizeof(float));
+				}
+				spilled[z] = bool(file);
+			}
+
+			for (auto &c : coeffs)
+				bytes -= c.total() * c.elemSize();
+			lru.pop_back();
+			resident.erase(it);
+		}
+	}
+
+	//Selection priority of the sample of class x at (row, col) of the padded image
+	uint64_t samplePriority(int x, int row, int col){
+		std::array<uint32_t, 4> r = PhiloxEngine::block(sample_key, { { uint32_t(row), uint32_t(col), uint32_t(x), 0 } });
+		return (uint64_t(r[0]) << 32) | r[1];
+	}
+
+	//Counter streams of the Gibbs sampler, per iteration. Only the scalar stream is drawn in sequence;
+	//the noise matrices are addressed by element.
+	enum GibbsStream : uint32_t { kGibbsInit, kGibbsScalars, kGibbsEtaNonCradle, kGibbsEtaCradle, kGibbsXi };
+
+	const char model_magic[4] = { 'P', 'L', 'M', 'F' };
+	const int model_format = 2;		//Bump when the model file layout or the sampler changes
+
+	//64-bit FNV-1a hash of 'len' bytes, continuing from 'h'
+	uint64_t fnv1a(const void *data, size_t len, uint64_t h = 14695981039346656037ull){
+		const unsigned char *bytes = (const unsigned char *)data;
+		for (size_t i = 0; i < len; i++){
+			h ^= bytes[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	//Hash of the size and elements of a float matrix, continuing from 'h'
+	uint64_t fnv1a(const cv::Mat &m, uint64_t h){
+		int dims[] = { m.rows, m.cols };
+		h = fnv1a(dims, sizeof(dims), h);
+		for (int i = 0; i < m.rows; i++)
+			h = fnv1a(m.ptr<float>(i), m.cols * sizeof(float), h);
+		return h;
+	}
+
+	//Cache file in 'dir' of the model trained on these (normalized) samples with these settings. A warm-started
+	//chain depends on the draw it starts from, so the last draw of the seed model is part of the key.
+	std::string modelCachePath(const std::string &dir, const std::vector<std::vector<float>> &cradle,
+		const std::vector<std::vector<float>> &noncradle, const gibbs_settings &settings){
+		const cradle_model_fitting *seed = settings.seed;
+		if (seed && (seed->Lambda_v.empty() || seed->Lambda_v.back().rows != int(cradle[0].size())))
+			seed = nullptr;		//Ignored by gibbsSampling()
+		int fields[] = { model_format, SEED, settings.min_burn, settings.max_burn, settings.samples, settings.window,
+			settings.adaptive, seed != nullptr };
+		uint64_t h = fnv1a(fields, sizeof(fields));
+		h = fnv1a(&settings.rhat, sizeof(float), h);
+		if (seed){
+			h = fnv1a(seed->Lambda_v.back(), h);
+			h = fnv1a(seed->Gamma_v.back(), h);
+			h = fnv1a(seed->ps_v.back(), h);
+			h = fnv1a(seed->kappa_v.back(), h);
+		}
+		for (const std::vector<std::vector<float>> *set : { &cradle, &noncradle }){
+			int n = set->size();
+			h = fnv1a(&n, sizeof(int), h);
+			for (const std::vector<float> &s : *set)
+				h = fnv1a(s.data(), s.size() * sizeof(float), h);
+		}
+
+		char name[17];
+		std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)h);
+		return dir + "/platypus_model_" + name + ".bin";
+	}
+
+	void writeMat(std::ofstream &file, const cv::Mat &m){
+		cv::Mat data = m.isContinuous() ? m : m.clone();
+		int dims[] = { data.rows, data.cols };
+		file.write((const char *)dims, sizeof(dims));
+		if (!data.empty())
+			file.write((const char *)data.ptr<float>(), data.total() * sizeof(float));
+	}
+
+	bool readMat(std::ifstream &file, cv::Mat &m){
+		int dims[2] = { 0, 0 };
+		file.read((char *)dims, sizeof(dims));
+		if (!file || dims[0] < 0 || dims[1] < 0 || (long long)dims[0] * dims[1] > (1 << 26))
+			return false;
+		m.release();
+		if (dims[0] * dims[1] > 0){
+			m.create(dims[0], dims[1], CV_32F);
+			file.read((char *)m.ptr<float>(), m.total() * sizeof(float));
+		}
+		return bool(file);
+	}
+
+	void writeMats(std::ofstream &file, const std::vector<cv::Mat> &v){
+		int count = v.size();
+		file.write((const char *)&count, sizeof(int));
+		for (const cv::Mat &m : v)
+			writeMat(file, m);
+	}
+
+	bool readMats(std::ifstream &file, std::vector<cv::Mat> &v, int count){
+		int stored = -1;
+		file.read((char *)&stored, sizeof(int));
+		if (!file || stored != count)
+			return false;
+		v = std::vector<cv::Mat>(count);
+		for (cv::Mat &m : v){
+			if (!readMat(file, m))
+				return false;
+		}
+		return true;
+	}
 	}  // namespace
 
 	//Shearlet decomposition horizontal/vertical angle parameters
@@ -54,51 +472,19 @@ namespace TextureRemoval{
 	int target_h[] = { 0, 0, 0, 1, 0, 0, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
 	int target_dim = 26;
 
-	//Used as buffer for file writing/reading
-	float buffer[block_size*block_size];
-
-	//Entry point to texture separation
-	Status textureRemove(
-		cv::Mat &img,								//Input image for wood grain separation
-		cv::Mat &mask_orig,							//Mask component, as returned by cradle removal step
-		cv::Mat &out,								//Result image is stored here
-		const CradleFunctions::MarkedSegments &ms	//Processing information, as returned by cradle removal step
-	){
-		Status status = Status::kSuccess;
+	block_plan planBlocks(const cv::Mat &mask_orig, const cv::Mat &piece_mask, const block_layout &layout){
+		CV_Assert(validBlockLayout(layout));
+		const int block_size = layout.size;
+		const int overlap = layout.overlap;
 
-		//Create borders for image
-		cv::Mat in, mask, piecemark;
-		cv::copyMakeBorder(img, in, overlap / 2, overlap / 2, overlap / 2, overlap / 2, cv::BORDER_REFLECT);
-
-		//Create borders for mask
-		cv::copyMakeBorder(mask_orig, mask, overlap / 2, overlap / 2, overlap / 2, overlap / 2, cv::BORDER_REFLECT);
-
-		//Create border for piece mask
-		cv::copyMakeBorder(ms.piece_mask, piecemark, overlap / 2, overlap / 2, overlap / 2, overlap / 2, cv::BORDER_REFLECT);
-
-		int N = in.rows;
-		int M = in.cols;
-
-		//Dictionaries for texture/cartoon separation
-		std::vector<int> dict(2);
-		dict[0] = MCA::FDCT;
-		dict[1] = MCA::DTWDC;
-
-		int sx, sy, ex, ey;
-		cv::Mat cartoon, texture;
-
-		cartoon = cv::Mat(N, M, CV_32F, cv::Scalar(0));
-		texture = cv::Mat(N, M, CV_32F, cv::Scalar(0));
-
-		//Parameters used for progress measuring
-		int nr_blocks = (N / (block_size - overlap) + 1) * (M / (block_size - overlap) + 1);	//Approximate number of blocks in the image
-		int processed = 0;
-		int tot_progress = 10 + 1 + ms.pieceIDh.size() + ms.pieceIDv.size();	//10 for MCA, 1 for sampling globally, 1 for each H/V piece
-		bool canceled = false;
+		block_plan plan;
+		const int pad = plan.pad = overlap / 2;
+		int N = mask_orig.rows + 2 * pad;
+		int M = mask_orig.cols + 2 * pad;
 
 		//Store integer coordinates of blocks
-		std::vector<std::vector<int>> coords;
-		sx = sy = 0;
+		std::vector<std::vector<int>> &coords = plan.coords;
+		int sx = 0, sy = 0, ex, ey;
 		
 		//Generate coordinates of blocks
 		while (sx < N){
@@ -128,16 +514,148 @@ namespace TextureRemoval{
 			}
 		}
 
+		//Blocks with cradle samples (these are separated and reconstructed, so they need every subband)
+		std::vector<bool> &reconstructed = plan.reconstructed;
+		reconstructed.assign(coords.size(), false);
+		for (int z = 0; z < coords.size(); z++){
+			int csx = coords[z][0], csy = coords[z][1], cex = coords[z][2], cey = coords[z][3];
+			if (csx != 0)
+				csx += overlap / 2;
+			if (csy != 0)
+				csy += overlap / 2;
+			if (cex != N)
+				cex -= overlap / 2;
+			if (cey != M)
+				cey -= overlap / 2;
+
+			cv::Mat mask, piecemark;
+			cv::Rect centre(cv::Point(csy, csx), cv::Point(cey, cex));
+			paddedRegion(mask_orig, pad, centre, mask);
+			paddedRegion(piece_mask, pad, centre, piecemark);
+
+			for (int i = 0; i < cex - csx && !reconstructed[z]; i += SN){
+				for (int j = 0; j < cey - csy; j += SM){
+					if ((mask.at<char>(i, j) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT && piecemark.at<ushort>(i, j) > 0){
+						reconstructed[z] = true;
+						break;
+					}
+				}
+			}
+		}
+
+		//Blocks that are sampled: all blocks with cradle, and an evenly spread subset of the others for the
+		//non-cradle statistics (a single block already yields more samples than the training sets keep)
+		std::vector<bool> &sampled = plan.sampled;
+		sampled = reconstructed;
+		std::vector<int> others;
+		for (int z = 0; z < coords.size(); z++){
+			if (!reconstructed[z])
+				others.push_back(z);
+		}
+		int picks = std::min<int>(others.size(), max_noncradle_blocks);
+		for (int i = 0; i < picks; i++){
+			sampled[others[(2 * i + 1) * others.size() / (2 * picks)]] = true;
+		}
+
+		//MCA is needed on the sampled blocks, and on every block whose centre lies in their extent, as the
+		//shearlet transform of a block sees the texture of its overlap. The other blocks keep their input.
+		std::vector<int> &decomposed = plan.decomposed;
+		for (int y = 0; y < coords.size(); y++){
+			int csx = coords[y][0], csy = coords[y][1], cex = coords[y][2], cey = coords[y][3];
+			if (csx != 0)
+				csx += overlap / 2;
+			if (csy != 0)
+				csy += overlap / 2;
+			if (cex != N)
+				cex -= overlap / 2;
+			if (cey != M)
+				cey -= overlap / 2;
+			cv::Rect centre(cv::Point(csy, csx), cv::Point(cey, cex));
+
+			for (int z = 0; z < coords.size(); z++) if (sampled[z]){
+				cv::Rect extent(cv::Point(coords[z][1], coords[z][0]), cv::Point(coords[z][3], coords[z][2]));
+				if ((extent & centre).area() > 0){
+					decomposed.push_back(y);
+					break;
+				}
+			}
+		}
+
+		return plan;
+	}
+
+	//Entry point to texture separation
+	Status textureRemove(
+		cv::Mat &img,								//Input image for wood grain separation
+		cv::Mat &mask_orig,							//Mask component, as returned by cradle removal step
+		cv::Mat &out,								//Result image is stored here
+		const CradleFunctions::MarkedSegments &ms,	//Processing information, as returned by cradle removal step
+		const texture_removal_options &options,
+		texture_removal_report *report
+	){
+		Status status = Status::kSuccess;
+		const int block_size = options.layout.size;	//Image block size for processing wood-grain separation
+		const int overlap = options.layout.overlap;	//Amount of overlap between neighboring blocks
+
+		//Blocks are laid out on the image with a reflected border of overlap / 2; the padded image, mask
+		//and piece mask are only formed block by block (paddedRegion)
+		const int pad = overlap / 2;
+		int N = img.rows + 2 * pad;
+		int M = img.cols + 2 * pad;
+
+		//Dictionaries for texture/cartoon separation
+		std::vector<int> dict(2);
+		dict[0] = MCA::FDCT;
+		dict[1] = MCA::DTWDC;
+
+		//Texture part of the padded image, tiled and spilled beyond its memory budget. The cartoon part is
+		//not kept: the result is the input plus every change separation makes to the MCA texture.
+		TileStore texture(N, M, options.texture_bytes, options.texture_dir);
+		cv::Mat result;
+		img.convertTo(result, CV_32F);
+
+		//Parameters used for progress measuring
+		int nr_blocks = (N / (block_size - overlap) + 1) * (M / (block_size - overlap) + 1);	//Approximate number of blocks in the image
+		int processed = 0;
+		int tot_progress = 10 + 1 + ms.pieceIDh.size() + ms.pieceIDv.size();	//10 for MCA, 1 for sampling globally, 1 for each H/V piece
+		bool canceled = false;
+
+		//Every written region of the result is published for preview
+		auto writeTexture = [&](const cv::Rect &r, const cv::Mat &pixels){
+			cv::Mat change;
+			texture.read(r, change);
+			cv::subtract(pixels, change, change);
+			cv::Rect visible = (r - cv::Point(pad, pad)) & cv::Rect(0, 0, result.cols, result.rows);
+			if (visible.area() > 0){
+				result(visible) += change(visible + cv::Point(pad, pad) - r.tl());
+				#pragma omp critical
+				if (!CradleFunctions::region(visible, result(visible)))
+					canceled = true;
+			}
+			texture.write(r, pixels);
+		};
+
+		//Blocks and the work they need
+		block_plan plan = planBlocks(mask_orig, ms.piece_mask, options.layout);
+		const std::vector<std::vector<int>> &coords = plan.coords;
+		const std::vector<bool> &reconstructed = plan.reconstructed, &sampled = plan.sampled;
+		const std::vector<int> &decomposed = plan.decomposed;
+		if (report){
+			*report = texture_removal_report();
+			report->blocks = coords.size();
+		}
+
 		//MCA decomposition
 		#pragma omp parallel for
-		for (int l = 0; l < coords.size(); l++){
+		for (int d = 0; d < decomposed.size(); d++){
 			//Parallelized texture/cartoon separation loop
+			int l = decomposed[d];
 
 			#pragma omp flush (canceled)
 			if (!canceled)
 			{
 				#pragma omp atomic
-				processed = (int)(l * 10/ coords.size());
+				processed = (int)(d * 10/ decomposed.size());
 			
 				// progress/abort
 				#pragma omp critical
@@ -152,14 +670,15 @@ namespace TextureRemoval{
 					int ey = coords[l][3];
 
 					//Make tmp a small segment copy of input
-					cv::Mat ctn, txt;
-					cv::Mat tmp(ex - sx, ey - sy, CV_32F);
-					for (int i = sx; i < ex; i++){
-						for (int j = sy; j < ey; j++){
-							tmp.at<float>(i - sx, j - sy) = in.at<float>(i, j);
-						}
+					cv::Mat ctn, txt, tmp;
+					paddedRegion(img, pad, cv::Rect(sy, sx, ey - sy, ex - sx), tmp);
+					if (tmp.type() != CV_32F)
+						tmp.convertTo(tmp, CV_32F);
+					MCA::MCA_Bcr(tmp, dict, txt, ctn, block_size);
+					if (report){
+						#pragma omp atomic
+						report->decomposed++;
 					}
-					MCA::MCA_Bcr(tmp, dict, txt, ctn);
 
 					//Save out result
 					int csx = sx, cex = ex, csy = sy, cey = ey;
@@ -168,12 +687,7 @@ namespace TextureRemoval{
 					if (ex != N) cex -= overlap / 2;
 					if (ey != M) cey -= overlap / 2;
 
-					for (int i = csx; i < cex; i++){
-						for (int j = csy; j < cey; j++){
-							texture.at<float>(i, j) = txt.at<float>(i - sx, j - sy);
-							cartoon.at<float>(i, j) = ctn.at<float>(i - sx, j - sy);
-						}
-					}
+					texture.write(cv::Rect(cv::Point(csy, csx), cv::Point(cey, cex)), txt(cv::Rect(cv::Point(csy - sy, csx - sx), cv::Point(cey - sy, cex - sx))));
 				}
 			}
 		}
@@ -181,17 +695,29 @@ namespace TextureRemoval{
 		if (canceled)
 			return status;
 
-		cartoon = in - texture;
-
-		cv::Mat new_texture = cv::Mat(texture.rows, texture.cols, CV_32F, cv::Scalar(0));
 		processed = 10;
 
-		//Create huge arrays of cradle/non-cradle sampled coefficients
-		std::vector<std::vector<float>> full_samples(in.rows * in.cols);
-		std::vector<int> sample_index(in.rows * in.cols);
+		//Subbands used as features
+		std::vector<bool> subbands(61);
+		for (int l = 0; l < 61; l++){
+			subbands[l] = target_h[l] == 1 || target_v[l] == 1;
+		}
+
+		//Default budget: the coefficients of every sampled block (all subbands for the reconstructed ones),
+		//up to a quarter of the physical memory
+		size_t cache_bytes = options.cache_bytes;
+		if (cache_bytes == auto_cache_bytes){
+			size_t plane = size_t(block_size) * block_size * sizeof(float);
+			size_t features = std::count(subbands.begin(), subbands.end(), true);
+			cache_bytes = 0;
+			for (int z = 0; z < coords.size(); z++) if (sampled[z])
+				cache_bytes += (reconstructed[z] ? subbands.size() : features) * plane;
+			size_t memory = physicalMemoryBytes();
+			cache_bytes = std::min(cache_bytes, memory > 0 ? memory / 4 : size_t(1) << 30);
+		}
 
-		//Index for sample position within array
-		int fsample_pos = 0;
+		//Shearlet coefficients of each block, shared by the sampling and separation passes
+		CoefficientCache cache(texture, coords, block_size, subbands, reconstructed, cache_bytes, options.cache_dir);
 
 		//Type of sampled piece (horizontal/vertical/cross section)
 		std::vector<int> sample_type(ms.pieceIDh.size() + ms.pieceIDv.size() + 2);
@@ -204,6 +730,25 @@ namespace TextureRemoval{
 			sample_type[i + 2 + ms.pieceIDh.size()] = CradleFunctions::VERTICAL_DIR;
 		}
 
+		//Cradle pieces owning each segment; structures built before the lookup table existed get one here
+		const CradleFunctions::MarkedSegments *owners = &ms;
+		CradleFunctions::MarkedSegments lookup;
+		if (ms.piece_h.size() < ms.pieces + 1 || ms.piece_v.size() < ms.pieces + 1){
+			lookup.pieces = ms.pieces;
+			lookup.pieceIDh = ms.pieceIDh;
+			lookup.pieceIDv = ms.pieceIDv;
+			CradleFunctions::buildPieceLookup(lookup);
+			owners = &lookup;
+		}
+		const std::vector<int> &piece_h = owners->piece_h;
+		const std::vector<int> &piece_v = owners->piece_v;
+		auto pieceOwner = [](const std::vector<int> &table, int id){
+			return id < table.size() ? table[id] : -1;
+		};
+
+		//Randomly selected cradle/non-cradle samples of every class, to reduce computation time
+		std::vector<SampleReservoir> reservoirs(sample_type.size(), SampleReservoir(max_samples, target_dim));
+
 		//Mark all blocks as unused
 		std::vector<std::vector<int>> block_used(ms.pieceIDh.size() + ms.pieceIDv.size() + 2);
 		for (int i = 0; i < block_used.size(); i++){
@@ -213,7 +758,9 @@ namespace TextureRemoval{
 		//Sample non-cradle parts for horizontal/vertical separation
 		for (int z = 0; z < coords.size(); z++){
 
-			if (!canceled){
+			if (!canceled && sampled[z]){
+				if (report)
+					report->sampled++;
 				// progress/abort
 				#pragma omp critical
 				if (!CradleFunctions::progress(processed, tot_progress))
@@ -235,106 +782,60 @@ namespace TextureRemoval{
 				if (ey != M)
 					cey -= overlap / 2;
 
-				std::vector<cv::Mat> coeffs;
-				//Block to work on
-				cv::Mat selection = cv::Mat(block_size, block_size, CV_32F, cv::Scalar(0));
-				for (int i = sx; i < ex; i++){
-					for (int j = sy; j < ey; j++){
-						selection.at<float>(i - sx, j - sy) = texture.at<float>(i, j);
-					}
-				}
+				//Decomposition of the block, kept for the separation pass
+				std::vector<cv::Mat> coeffs = cache.get(z);
 
-				//Save decomposition results to structure
-				coeffs = FFST::shearletTransformSpect(selection);
+				cv::Mat mask, piecemark;
+				cv::Rect centre(cv::Point(csy, csx), cv::Point(cey, cex));
+				paddedRegion(mask_orig, pad, centre, mask);
+				paddedRegion(ms.piece_mask, pad, centre, piecemark);
+
+				//Horizontal/vertical feature vectors of the sampling grid, one row per sample
+				cv::Mat features_h, features_v;
+				int fcols = (cey - csy + SM - 1) / SM;
+				interleaveSubbands(coeffs, target_h, cv::Size(cey - csy, cex - csx), SN, SM, features_h);
+				interleaveSubbands(coeffs, target_v, cv::Size(cey - csy, cex - csx), SN, SM, features_v);
 
 				//Add points to training set
 				for (int i = 0; i < cex - csx; i += SN){
-					for (int j = 0; j < cey - csy; j += SM) if ((mask.at<char>(i + csx, j + csy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT) {
+					for (int j = 0; j < cey - csy; j += SM) if ((mask.at<char>(i, j) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT) {
 
-						ushort pi = piecemark.at<ushort>(i + csx, j + csy) + 1;	//Index of the piece
-						int coeff_size = target_dim;
+						ushort pi = piecemark.at<ushort>(i, j) + 1;	//Index of the piece
 
 						if (pi > 1){
 
 							//Find horizontal cradle containing this segment (if any)
-							int hi = -1;
-							for (int temp1 = 0; temp1 < ms.pieceIDh.size(); temp1++){
-								for (int temp2 = 0; temp2 < ms.pieceIDh[temp1].size(); temp2++){
-									if (ms.pieceIDh[temp1][temp2] == pi - 1){
-										hi = temp1 + 2;
-									}
-								}
-							}
+							int hi = pieceOwner(piece_h, pi - 1);
+							if (hi != -1)
+								hi += 2;
 
 							if (hi != -1){
 								//Add sample to horizontal piece
-								full_samples[fsample_pos] = std::vector<float>(coeff_size);
-								sample_index[fsample_pos] = hi;
 								sample_type[hi] = CradleFunctions::HORIZONTAL_DIR;
 								block_used[hi][z] = 1;
-
-								//Fill up sample - horizontal
-								int lindex = 0;
-								for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-									full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-									lindex++;
-								}
-								fsample_pos++;
+								reservoirs[hi].add(features_h.ptr<float>((i / SN) * fcols + j / SM), samplePriority(hi, i + csx, j + csy));
 							}
 
-							//Find horizontal cradle containing this segment (if any)
-							int vi = -1;
-							for (int temp1 = 0; temp1 < ms.pieceIDv.size(); temp1++){
-								for (int temp2 = 0; temp2 < ms.pieceIDv[temp1].size(); temp2++){
-									if (ms.pieceIDv[temp1][temp2] == pi - 1){
-										vi = temp1 + 2 + ms.pieceIDh.size();
-									}
-								}
-							}
+							//Find vertical cradle containing this segment (if any)
+							int vi = pieceOwner(piece_v, pi - 1);
+							if (vi != -1)
+								vi += 2 + ms.pieceIDh.size();
 							if (vi != -1){
 								//Add sample to vertical piece
-								full_samples[fsample_pos] = std::vector<float>(coeff_size);
-								sample_index[fsample_pos] = vi;
 								sample_type[vi] = CradleFunctions::VERTICAL_DIR;
 								block_used[vi][z] = 1;
-
-								///Fill up sample - vertical
-								int lindex = 0;
-								for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-									full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-									lindex++;
-								}
-								fsample_pos++;
+								reservoirs[vi].add(features_v.ptr<float>((i / SN) * fcols + j / SM), samplePriority(vi, i + csx, j + csy));
 							}
 						}
 						else{
 							//No horizontal or vertical mask piece present
 							pi = 0;	//Horizontal non-cradle index
-							int coeff_size = target_dim;
-							full_samples[fsample_pos] = std::vector<float>(coeff_size);
-							sample_index[fsample_pos] = pi;
 							block_used[pi][z] = 1;
-
-							//Fill up sample - horizontal
-							int lindex = 0;
-							for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-								full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-								lindex++;
-							}
-							fsample_pos++;
+							reservoirs[pi].add(features_h.ptr<float>((i / SN) * fcols + j / SM), samplePriority(pi, i + csx, j + csy));
 
 							pi = 1;	//Vertical non-cradle index
-							full_samples[fsample_pos] = std::vector<float>(coeff_size);
-							sample_index[fsample_pos] = pi;
 							block_used[pi][z] = 1;
-
-							//Fill up sample - vertical
-							lindex = 0;
-							for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-								full_samples[fsample_pos][lindex] = coeffs[l].at<float>(i, j);
-								lindex++;
-							}
-							fsample_pos++;
+							reservoirs[pi].add(features_v.ptr<float>((i / SN) * fcols + j / SM), samplePriority(pi, i + csx, j + csy));
 						}
 					}
 				}
@@ -343,37 +844,13 @@ namespace TextureRemoval{
 		processed++;
 		if (canceled)
 			return status;
-		full_samples.resize(fsample_pos);
 
-		std::vector<int> sample_pos(sample_type.size());
+		//Training sets of every class
 		std::vector<std::vector<std::vector<float>>> sample_select(sample_type.size());
-
-		//Randomly select samples to reduce computation time
 		for (int i = 0; i < sample_select.size(); i++){
-			int local_pos = 0;
-			std::vector<std::vector<float>> local(full_samples.size());
-			//Find all samples with corresponding number
-			for (int j = 0; j < full_samples.size(); j++){
-				if (sample_index[j] == i){
-					//Copy sample to local selection
-					local[local_pos] = std::vector<float>(full_samples[j].size());
-					for (int k = 0; k < full_samples[j].size(); k++){
-						local[local_pos][k] = full_samples[j][k];
-					}
-					local_pos++;
-				}
-			}
-
-			//Resize
-			local.resize(local_pos);
-
-			//Sample randomly
-			sampleDataset(local, sample_select[i], max_samples);
+			sample_select[i] = reservoirs[i].samples();
 		}
-
-		//Drop global selection of coefficients to save memory
-		full_samples.clear();
-		sample_index.clear();
+		reservoirs.clear();
 
 		//Normalize non-cradled components
 		std::vector<float> mean_h, mean_v, var_h, var_v;
@@ -386,6 +863,8 @@ namespace TextureRemoval{
 
 		//Train separation model on each cradle piece
 		cradle_model_fitting model;
+		gibbs_workspace gibbs_ws;	//Sampler buffers, shared by all pieces
+		std::map<int, cradle_model_fitting> last_model;	//Latest model per direction, for warm starts
 
 		for (int mod_sel = 2; mod_sel < sample_select.size(); mod_sel++){
 
@@ -414,11 +893,25 @@ namespace TextureRemoval{
 				if (ncdata.empty())
 					return Status::kInsufficientSamples;
 
-				//Train the model
-				model = gibbsSampling(sample_select[mod_sel], ncdata);
-				
-				cv::Mat new_texture;
-				texture.copyTo(new_texture);
+				//Train the model, unless it was trained before on the same samples
+				gibbs_settings settings = options.gibbs;
+				cradle_model_fitting &previous = last_model[sample_type[mod_sel]];
+				if (options.warm_start && !previous.Lambda_v.empty())
+					settings.seed = &previous;
+
+				std::string cached = options.model_dir.empty() ? std::string() :
+					modelCachePath(options.model_dir, sample_select[mod_sel], ncdata, settings);
+				if (cached.empty() || !loadModel(cached, model)){
+					model = gibbsSampling(sample_select[mod_sel], ncdata, gibbs_ws, settings);
+					if (!cached.empty())
+						saveModel(model, cached);
+				}
+				if (options.warm_start)
+					previous = model;
+
+				//Border strips of the rewritten block centres that other blocks of this piece read in their
+				//overlap; they are written to the texture once every block is separated
+				std::vector<std::vector<std::pair<cv::Rect, cv::Mat>>> deferred(coords.size());
 
 				// progress/abort
 				#pragma omp critical
@@ -447,567 +940,332 @@ namespace TextureRemoval{
 						if (ey != M)
 							cey -= overlap / 2;
 
-						std::vector<cv::Mat> coeffs;
-						//Block to work on
-						cv::Mat selection = cv::Mat(block_size, block_size, CV_32F, cv::Scalar(0));
-						for (int i = sx; i < ex; i++){
-							for (int j = sy; j < ey; j++){
-								selection.at<float>(i - sx, j - sy) = texture.at<float>(i, j);
-							}
-						}
-
-						//Save decomposition results to structure
-						coeffs = FFST::shearletTransformSpect(selection);
-						
-						//Use this to store samples
-						std::vector<std::vector<float>> clusters(block_size * block_size / PSN / PSM * 2);
-						int sample_pos = 0;
-
-						//Subsample coefficients for clustering
-						for (int i = 0; i < ex - sx; i += PSN){
-							for (int j = 0; j < ey - sy; j += PSM) if ((mask.at<char>(i + sx, j + sy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT){
-
-								int pi = piecemark.at<ushort>(i + sx, j + sy) + 1;	//Index of the piece
-								int coeff_size = target_dim;
-
-								if (pi > 1){
-									int ci;
-									bool partOfCradle = false;
-
-									if (mod_sel >= 2 + ms.pieceIDh.size()){
-										//It's a vertical cradle piece
-										ci = mod_sel - 2 - ms.pieceIDh.size();
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
-											if (ms.pieceIDv[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply vertical separation
-										if (partOfCradle){
-											clusters[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up sample - vertical
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-												clusters[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
-											}
-											sample_pos++;
-										}
-
-									}
-									else{
-										//It's a horizontal cradle piece
-										ci = mod_sel - 2;
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
-											if (ms.pieceIDh[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply horizontal separation
-										if (partOfCradle){
-											clusters[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up samle - horizontal
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-												clusters[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
-											}
-											sample_pos++;
-										}
-									}
-								}
+						//Decomposition of the block, and the subbands of this piece's direction
+						//pixel-interleaved, one row of features per pixel of the block
+						std::vector<cv::Mat> coeffs = cache.get(z);
+						const int *target = mod_sel >= 2 + ms.pieceIDh.size() ? target_v : target_h;
+						cv::Mat mask, piecemark;
+						paddedRegion(mask_orig, pad, cv::Rect(sy, sx, ey - sy, ex - sx), mask);
+						paddedRegion(ms.piece_mask, pad, cv::Rect(sy, sx, ey - sy, ex - sx), piecemark);
+						cv::Mat features;
+						int fcols = ey - sy;
+						interleaveSubbands(coeffs, target, cv::Size(ey - sy, ex - sx), 1, 1, features);
+
+						//Whether pixel (i, j) of the block belongs to the cradle piece being separated
+						auto inPiece = [&](int i, int j){
+							if ((mask.at<char>(i, j) & CradleFunctions::DEFECT) == CradleFunctions::DEFECT)
+								return false;
+							int pi = piecemark.at<ushort>(i, j) + 1;	//Index of the piece
+							if (pi <= 1)
+								return false;
+							if (mod_sel >= 2 + ms.pieceIDh.size())
+								return pieceOwner(piece_v, pi - 1) == mod_sel - 2 - int(ms.pieceIDh.size());	//Vertical cradle piece
+							return pieceOwner(piece_h, pi - 1) == mod_sel - 2;	//Horizontal cradle piece
+						};
+
+						//Rows of 'features' to separate, and the subsampled ones used as clusters
+						std::vector<int> sample_rows, cluster_rows;
+						for (int i = 0; i < ex - sx; i++){
+							for (int j = 0; j < ey - sy; j++) if (inPiece(i, j)){
+								sample_rows.push_back(i * fcols + j);
+								if (i % PSN == 0 && j % PSM == 0)
+									cluster_rows.push_back(i * fcols + j);
 							}
 						}
-						//Drop unused elements
-						clusters.resize(sample_pos);
+
 						bool clustering = false;
-						int neighbor_count = 0;
-						cv::Mat clusters_mat;
-						std::unique_ptr<cv::flann::GenericIndex<cvflann::L2<float>>> kdTree;
-						if (!clusters.empty()) {
-							clusters_mat.create(int(clusters.size()), int(clusters[0].size()), CV_32F);
-							for (int i = 0; i < clusters_mat.rows; i++){
-								for (int j = 0; j < clusters_mat.cols; j++){
-									clusters_mat.at<float>(i, j) = clusters[i][j];
-								}
-							}
+						int neighbor_count = std::min<int>(NR_NEIGHBOURS, cluster_rows.size());
+						cv::Mat clusters_mat, clusters_diffs_mat;
+						if (neighbor_count > 0) {
+							clustering = true;
+							if (neighbor_count < NR_NEIGHBOURS)
+								promoteStatus(status, Status::kLimitedLocalSamples);
 
-							neighbor_count = std::min<int>(NR_NEIGHBOURS, clusters_mat.rows);
-							if (neighbor_count > 0) {
-								kdTree.reset(new cv::flann::GenericIndex<cvflann::L2<float>>(
-									clusters_mat, cvflann::KDTreeIndexParams(4)));
-								clustering = true;
-								if (neighbor_count < NR_NEIGHBOURS)
-									promoteStatus(status, Status::kLimitedLocalSamples);
-							}
+							//Post inference for subsampled coefficients
+							gatherRows(features, cluster_rows, clusters_mat);
+							post_inference(model, clusters_mat, clusters_diffs_mat);
 						}
-						if (!clustering)
+						else
 							promoteStatus(status, Status::kFallbackModel);
-
-						//Post inference for subsampled coefficients
-						std::vector<std::vector<float>> clusters_diffs;
-						if (!clusters.empty())
-							post_inference(model, clusters, ncdata, clusters_diffs);
-						
-						//Look up all coefficients
-						sample_pos = 0;
-						std::vector<std::vector<float>> samples(block_size * block_size);
-						for (int i = 0; i < ex - sx; i++){
-							for (int j = 0; j < ey - sy; j++) if ((mask.at<char>(i + sx, j + sy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT){
-
-								int pi = piecemark.at<ushort>(i + sx, j + sy) + 1;	//Index of the piece
-								int coeff_size = target_dim;
-
-								if (pi > 1){
-									int ci;
-									bool partOfCradle = false;
-
-									if (mod_sel >= 2 + ms.pieceIDh.size()){
-										//It's a vertical cradle piece
-										ci = mod_sel - 2 - ms.pieceIDh.size();
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
-											if (ms.pieceIDv[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply vertical separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up sample - vertical
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-												samples[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
-											}
-											sample_pos++;
-										}
-
-									}
-									else{
-										//It's a horizontal cradle piece
-										ci = mod_sel - 2;
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
-											if (ms.pieceIDh[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply horizontal separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up samle - horizontal
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-												samples[sample_pos][lindex] = coeffs[l].at<float>(i, j);
-												lindex++;
-											}
-											sample_pos++;
-										}
-									}
-								}
-							}
-						}
-						//Drop unused elements
-						samples.resize(sample_pos);
 
-						std::vector<std::vector<float>> ncdata;	//Non-cradle data samples for post-inference
+						//Coefficients to separate, one sample per row
+						cv::Mat samples;
+						gatherRows(features, sample_rows, samples);
 
-						//Normalize the data & choose reference non-cradle data set
-						if (samples.size() != 0){
+						//Normalize the data
+						if (samples.rows != 0){
 							if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
 								if (!has_h_noncradle)
 									return Status::kInsufficientSamples;
 								normalizeSamples(samples, mean_h, var_h);
-								ncdata = sample_select[0];
 							}
 							else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
 								if (!has_v_noncradle)
 									return Status::kInsufficientSamples;
 								normalizeSamples(samples, mean_v, var_v);
-								ncdata = sample_select[1];
 							}
 							else{
-								//Cross section
+								//Cross section: no reference non-cradle data set
+								return Status::kInsufficientSamples;
 							}
 						}
 
-						std::vector<std::vector<float>> diffs;
-						if (samples.size() != 0){
-							if (ncdata.empty())
-								return Status::kInsufficientSamples;
+						cv::Mat diffs;
+						if (samples.rows != 0){
 							if (clustering){
-								//Convert samples to a cv::Mat
-								cv::Mat samples_mat(samples.size(), samples[0].size(), CV_32F);
-								for (int a = 0; a < samples.size(); a++){
-									for (int b = 0; b < samples[0].size(); b++){
-										samples_mat.at<float>(a, b) = samples[a][b];
-									}
-								}
-
-								//Use clustering for separation
-								diffs = std::vector<std::vector<float>>(samples.size());
-								for (int i = 0; i < diffs.size(); i++){
-									diffs[i] = std::vector<float>(samples[i].size());
-								}
-
-								cv::Mat neighborsIdx; //This mat will contain the index of nearest neighbour as returned by Kd-tree
-								cv::Mat distances; //In this mat Kd-Tree return the distances for each nearest neighbour
-
-								//Initialize structures
-								neighborsIdx.create(cv::Size(neighbor_count, samples_mat.rows), CV_32SC1);
-								distances.create(cv::Size(neighbor_count, samples_mat.rows), CV_32FC1);
-
-								//Run KD search
-								kdTree->knnSearch(samples_mat, neighborsIdx, distances, neighbor_count, cvflann::SearchParams(8));
-
-								for (int i = 0; i < samples.size(); i++){
-									//Get weights
-									std::vector<float> weights(neighbor_count);
-									float sumweight = 0;
-									for (int j = 0; j < neighbor_count; j++){
-										weights[j] = 1.0 / (1 + distances.at<float>(i, j));
-										sumweight += weights[j];
-									}
-
-									//Get interpolated decomposition
-									for (int k = 0; k < neighbor_count; k++){
-										float cweight = weights[k] / sumweight;
-										for (int j = 0; j < samples[i].size(); j++){
-											diffs[i][j] += clusters_diffs[neighborsIdx.at<int>(i, k)][j] * cweight;
-										}
-									}
-								}
+								//Use clustering for separation: interpolate the separation of the nearest cluster samples
+								knnInterpolate(samples, clusters_mat, clusters_diffs_mat, neighbor_count, diffs);
 							}
 							else{
 								//Do the full post-inference
-								post_inference(model, samples, ncdata, diffs);
+								post_inference(model, samples, diffs);
 							}
-						}
 
-						//Unnormalize separation data
-						if (samples.size() != 0){
+							//Unnormalize separation data
 							if (sample_type[mod_sel] == CradleFunctions::HORIZONTAL_DIR){
 								unNormalizeSamples(diffs, mean_h, var_h);
 							}
-							else if (sample_type[mod_sel] == CradleFunctions::VERTICAL_DIR){
-								unNormalizeSamples(diffs, mean_v, var_v);
-							}
 							else{
-								//Cross section
-								unNormalizeSamplesCrossSection(diffs, mean_h, var_h, mean_v, var_v);
+								unNormalizeSamples(diffs, mean_v, var_v);
 							}
 						}
 
-						//Reset index of sample_pos
-						sample_pos = 0;
-						
 						//Apply separation to the decomposition coefficients
-						for (int i = 0; i < ex - sx; i++){
-							for (int j = 0; j < ey - sy; j++) if ((mask.at<char>(i + sx, j + sy) & CradleFunctions::DEFECT) != CradleFunctions::DEFECT) {
-
-								int pi = piecemark.at<ushort>(i + sx, j + sy) + 1;	//Index of the piece
-								int coeff_size = target_dim;
-								
-								if (pi > 1){
-									int ci;
-									bool partOfCradle = false;
-
-									if (mod_sel >= 2 + ms.pieceIDh.size()){
-										//It's a vertical cradle piece
-										ci = mod_sel - 2 - ms.pieceIDh.size();
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDv[ci].size(); temp++){
-											if (ms.pieceIDv[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply vertical separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up sample - vertical
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_v[l] == 1){
-												coeffs[l].at<float>(i, j) -= diffs[sample_pos][lindex];
-												//coeffs[l].at<float>(i, j) = 0;
-												lindex++;
-											}
-											sample_pos++;
-										}
-
-									}
-									else{
-										//It's a horizontal cradle piece
-										ci = mod_sel - 2;
-
-										//Check if segment is part of the cradle
-										for (int temp = 0; temp < ms.pieceIDh[ci].size(); temp++){
-											if (ms.pieceIDh[ci][temp] == pi - 1)
-												partOfCradle = true;
-										}
-
-										//Apply horizontal separation
-										if (partOfCradle){
-											samples[sample_pos] = std::vector<float>(coeff_size);
-
-											//Fill up sample - horizontal
-											int lindex = 0;
-											for (int l = 0; l < 61; l++) if (target_h[l] == 1){
-												coeffs[l].at<float>(i, j) -= diffs[sample_pos][lindex];
-												//coeffs[l].at<float>(i, j) = 0;
-												lindex++;
-											}
-											sample_pos++;
-										}
-									}
-								}
+						for (int r = 0; r < sample_rows.size(); r++){
+							float *f = features.ptr<float>(sample_rows[r]);
+							const float *d = diffs.ptr<float>(r);
+							for (int l = 0; l < target_dim; l++){
+								f[l] -= d[l];
 							}
 						}
 
-						//Reconstruct block
-						reconstructBlock(new_texture, coeffs, sx, sy, csx, csy, cex, cey);
+						//Write the separated subbands back (to copies, the cached planes stay intact)
+						for (int l = 0; l < 61; l++) if (target[l] == 1){
+							coeffs[l] = coeffs[l].clone();
+						}
+						deinterleaveSubbands(features, target, cv::Size(ey - sy, ex - sx), 1, 1, coeffs);
+
+						//Reconstruct block; the centre away from the overlaps is read by no other block
+						cv::Rect inner(cv::Point(sy != 0 ? csy + overlap / 2 : csy, sx != 0 ? csx + overlap / 2 : csx),
+							cv::Point(ey != M ? cey - overlap / 2 : cey, ex != N ? cex - overlap / 2 : cex));
+						std::pair<cv::Rect, cv::Mat> direct;
+						reconstructBlock(coeffs, sx, sy, csx, csy, cex, cey, inner, direct, deferred[z]);
+						if (direct.first.area() > 0)
+							writeTexture(direct.first, direct.second);
+					}
+				}
+				for (auto &block : deferred){
+					for (auto &strip : block)
+						writeTexture(strip.first, strip.second);
+				}
+
+				//Blocks overlapping a rewritten block centre have to be transformed again
+				for (int z = 0; z < coords.size(); z++) if (block_used[mod_sel][z] == 1){
+					int csx = coords[z][0], csy = coords[z][1], cex = coords[z][2], cey = coords[z][3];
+					if (csx != 0)
+						csx += overlap / 2;
+					if (csy != 0)
+						csy += overlap / 2;
+					if (cex != N)
+						cex -= overlap / 2;
+					if (cey != M)
+						cey -= overlap / 2;
+					cv::Rect written(cv::Point(csy, csx), cv::Point(cey, cex));
+
+					for (int y = 0; y < coords.size(); y++){
+						cv::Rect extent(cv::Point(coords[y][1], coords[y][0]), cv::Point(coords[y][3], coords[y][2]));
+						if ((extent & written).area() > 0)
+							cache.invalidate(y);
 					}
 				}
-				new_texture.copyTo(texture);
 			}
 		}
 		if (!canceled)
 		{
 			//Final image
-			out = texture + cartoon;
-
-			//Remove padding
-			out = out(cv::Range(overlap / 2, N - overlap / 2), cv::Range(overlap / 2, M - overlap / 2));
+			out = result;
 		}
 		return status;
 	}
 
 	void post_inference(cradle_model_fitting &model, std::vector<std::vector<float>> &c, std::vector<std::vector<float>> &nc, std::vector<std::vector<float>> &difference){
-		std::default_random_engine generator;
-
-		generator.seed(SEED);
 		int p = c[0].size();
-		int nsample = model.etac_v.size();
-
-		int k1 = model.Lambda_v[0].cols;
-		int k2 = model.Gamma_v[0].cols;
-
-		int Nnoncradle = nc.size();
 		int Ncradle = c.size();
 
-		//Convert cradle/noncradle coefficients to matrix
-		cv::Mat cradleMat(Ncradle, p, CV_32F);			//z(~x,:)
-		cv::Mat noncradleMat(Nnoncradle, p, CV_32F);	//z( x,:)
+		//Convert cradle coefficients to matrix; the non-cradle samples do not enter the posterior mean
+		cv::Mat cradleMat(Ncradle, p, CV_32F), fits;
 		for (int i = 0; i < Ncradle; i++){
-			for (int j = 0; j < p; j++){
-				cradleMat.at<float>(i, j) = c[i][j];
-			}
+			std::copy(c[i].begin(), c[i].end(), cradleMat.ptr<float>(i));
 		}
-		for (int i = 0; i < Nnoncradle; i++){
-			for (int j = 0; j < p; j++){
-				noncradleMat.at<float>(i, j) = nc[i][j];
-			}
-		}
-		cv::Mat fits(Ncradle, p, CV_32F, cv::Scalar(0));
-		cv::Mat Lmsgt, Lmsg;
-		cv::Mat Veta, Veta1;
-		cv::Mat Vvect, U, S, Strans;
-		cv::Mat Meta;
-		cv::Mat eta_nc, eta_nctmp;
-		cv::Mat Gammat, tmp;
-		cv::Mat lambdat;
-		cv::Mat z_nc_c, z_nc_nc, z_c;
-		cv::Mat Gmsg, Gmsgt, Vxi1, Vxi, Mxi, xi;
-
-		//Get fitting
-		for (int i = 0; i < nsample; i++){
-			//Go through all samples
-
-			/*******************
-			* Non-cradle signal
-			*******************/
-			Lmsg = cv::Mat(p, k1, CV_32F);
-			for (int k = 0; k < p; k++){
-				for (int l = 0; l < k1; l++){
-					Lmsg.at<float>(k, l) = model.Lambda_v[i].at<float>(k, l) * model.ps_v[i].at<float>(0, k);
-				}
-			}
-			cv::transpose(Lmsg, Lmsgt);
-			//Lmsg = bsxfun(@times,Lambda,ps);
+		post_inference(model, cradleMat, fits);
 
-			Veta1 = Lmsgt * model.Lambda_v[i];
-			for (int j = 0; j < k1; j++){
-				Veta1.at<float>(j, j) += 1.0;
-			}
-			cv::invert(Veta1, Veta);
-			// Veta = inv(eye(k1) + Lmsg'*Lambda{i})
-
-			U = Cholesky(Veta1);
-			cv::invert(U, S);
-			cv::transpose(S, Strans);
-
-			//Sample eta
-			//Eta mean
-			Meta = noncradleMat * Lmsg * Veta;
-
-			//Sample zero-mean unit-variance uniform distribution
-			/*
-			eta_nctmp = cv::Mat(Meta.rows, Meta.cols, CV_32F, 0);
-			//normal_distr = std::normal_distribution<float>(0, 1);
-			for (int k = 0; k < eta_nctmp.rows; k++){
-				for (int l = 0; l < eta_nctmp.cols; l++){
-					eta_nctmp.at<float>(k, l) = normal_distr(generator);
-				}
-			}
-			*/
-			eta_nc = Meta;// +eta_nctmp*Strans;
-
-			/*******************
-			* Cradle signal
-			*******************/
-			cv::transpose(model.Gamma_v[i], Gammat);
-			tmp = model.Gamma_v[i] * Gammat;
-			for (int j = 0; j < Gammat.cols; j++){
-				tmp.at<float>(j, j) += 1.0 / model.ps_v[i].at<float>(0, j);
-			}
-			//Gamma{i}*Gamma{i}'+diag(1./ps{i})
-			cv::invert(tmp, Lmsg);
-			Lmsg = Lmsg * model.Lambda_v[i];
-			cv::transpose(Lmsg, Lmsgt);
-
-			Veta1 = model.rho_v[i] * model.rho_v[i] * Lmsgt * model.Lambda_v[i];
-			for (int j = 0; j < k1; j++){
-				Veta1.at<float>(j, j) += 1.0;
-			}
-			cv::invert(Veta1, Veta);
-			// Veta = inv(eye(k1) + rho(i)^2*Lmsg'*Lambda{i})
+		//Convert back to coefficient array
+		difference = std::vector<std::vector<float>>(Ncradle);
+		for (int i = 0; i < Ncradle; i++){
+			const float *f = fits.ptr<float>(i);
+			difference[i].assign(f, f + p);
+		}
+	}
 
-			//Mean
-			cv::Mat eta_c, eta_ctmp;
-			Meta = cradleMat * Lmsg * Veta;
+	void post_inference(cradle_model_fitting &model, const cv::Mat &cradleMat, cv::Mat &difference){
+		CV_Assert(cradleMat.type() == CV_32F);
+		int p = cradleMat.cols;
+		int nsample = model.Gamma_v.size();
+		int Ncradle = cradleMat.rows;	//z(~x,:)
+		cv::Mat fits(Ncradle, p, CV_32F, cv::Scalar(0));
 
-			//Sample zero-mean unit-variance uniform distribution
-			/*
-			eta_ctmp = cv::Mat(Meta.rows, Meta.cols, CV_32F, 0);
-			normal_distr = std::normal_distribution<float>(0, 1);
-			for (int k = 0; k < eta_ctmp.rows; k++){
-				for (int l = 0; l < eta_ctmp.cols; l++){
-					eta_ctmp.at<float>(k, l) = normal_distr(generator);
+		if (!model.W.empty()){
+			//Folded model: the average over all draws is a single affine map
+			cv::gemm(cradleMat, model.W, 1, cv::repeat(model.b, Ncradle, 1), 1, fits);
+		}
+		else{
+			//Posterior means only: the non-cradle part of eta and the noise terms (and with them
+			//the Cholesky factors of the covariances) do not contribute to the cradle fit
+			cv::Mat Lmsgt, Lmsg;
+			cv::Mat Veta1, U;
+			cv::Mat Gammat, tmp;
+			cv::Mat lambdat;
+			cv::Mat eta_c, z_nc_c, z_c;
+			cv::Mat Gmsg, Gmsgt, Vxi1, Mxi;
+
+			//Get fitting
+			for (int i = 0; i < nsample; i++){
+				int k1 = model.Lambda_v[i].cols;
+
+				/*******************
+				* Cradle signal
+				*******************/
+				cv::transpose(model.Gamma_v[i], Gammat);
+				tmp = model.Gamma_v[i] * Gammat;
+				for (int j = 0; j < Gammat.cols; j++){
+					tmp.at<float>(j, j) += 1.0 / model.ps_v[i].at<float>(0, j);
 				}
-			}*/
+				//Gamma{i}*Gamma{i}'+diag(1./ps{i})
+				Cholesky(tmp, U);
+				spdSolve(U, model.Lambda_v[i], Lmsg);
+				cv::transpose(Lmsg, Lmsgt);
 
-			U = Cholesky(Veta1);
-			cv::invert(U, S);
-			cv::transpose(S, Strans);
-
-			//Get multivariate normal distribution
-			eta_c = Meta;// +eta_ctmp * Strans;
-
-			/*******************
-			* Compute z_nc
-			*******************/
-
-			cv::transpose(model.Lambda_v[i], lambdat);
-			z_nc_nc = eta_nc * lambdat;					//z_nc(x,:) = eta(x,:)*Lambda{i}';
-			z_nc_c = eta_c * lambdat * model.rho_v[i];	//z_nc(~x,:) = eta(~x,:)*Lambda{i}'*rho(i);
-
-			/*******************
-			* Compute xi
-			*******************/
-			Gmsg = cv::Mat(model.Gamma_v[i].rows, model.Gamma_v[i].cols, CV_32F);
-			for (int k = 0; k < model.Gamma_v[i].rows; k++){
-				for (int l = 0; l < model.Gamma_v[i].cols; l++){
-					Gmsg.at<float>(k, l) = model.Gamma_v[i].at<float>(k, l) * model.ps_v[i].at<float>(0, k);
+				Veta1 = model.rho_v[i] * model.rho_v[i] * Lmsgt * model.Lambda_v[i];
+				for (int j = 0; j < k1; j++){
+					Veta1.at<float>(j, j) += 1.0;
 				}
-			}//Gmsg = bsxfun(@times, Gamma{ i }, ps{ i });
-			cv::transpose(Gmsg, Gmsgt);
-
-			Vxi1 = Gmsgt * model.Gamma_v[i];
-			for (int k = 0; k < Vxi1.cols; k++){
-				Vxi1.at<float>(k, k)++;
-			}//Vxi1 = eye(k2) + Gmsg'*Gamma{i};
+				// Veta = inv(eye(k1) + rho(i)^2*Lmsg'*Lambda{i})
+				Cholesky(Veta1, U);
+
+				//Mean
+				spdSolveRows(U, cradleMat * Lmsg, eta_c);
+
+				/*******************
+				* Compute z_nc
+				*******************/
+				cv::transpose(model.Lambda_v[i], lambdat);
+				z_nc_c = eta_c * lambdat * model.rho_v[i];	//z_nc(~x,:) = eta(~x,:)*Lambda{i}'*rho(i);
+
+				/*******************
+				* Compute xi
+				*******************/
+				Gmsg = cv::Mat(model.Gamma_v[i].rows, model.Gamma_v[i].cols, CV_32F);
+				for (int k = 0; k < model.Gamma_v[i].rows; k++){
+					for (int l = 0; l < model.Gamma_v[i].cols; l++){
+						Gmsg.at<float>(k, l) = model.Gamma_v[i].at<float>(k, l) * model.ps_v[i].at<float>(0, k);
+					}
+				}//Gmsg = bsxfun(@times, Gamma{ i }, ps{ i });
+				cv::transpose(Gmsg, Gmsgt);
 
-			cv::invert(Vxi1, Vxi);
+				Vxi1 = Gmsgt * model.Gamma_v[i];
+				for (int k = 0; k < Vxi1.cols; k++){
+					Vxi1.at<float>(k, k)++;
+				}//Vxi1 = eye(k2) + Gmsg'*Gamma{i};
 
-			Mxi = (cradleMat - z_nc_c) * Gmsg * Vxi; // (z(~x,:) - z_nc(~x,:))*Gmsg*Vxi
-			cv::Mat kappavxi = model.kappa_v[i] * Vxi;
-			for (int k = 0; k < Mxi.rows; k++){
-				for (int l = 0; l < Mxi.cols; l++){
-					Mxi.at<float>(k, l) = Mxi.at<float>(k, l) + kappavxi.at<float>(0, l);
-				}
-			}//Mxi = bsxfun(@plus, (z(~x, :) - z_nc(~x, :))*Gmsg*Vxi, kappa{ i }*Vxi);
+				Cholesky(Vxi1, U);
 
-			//Sample multivariate normal distribution
-			/*
-			cv::Mat samples(Mxi.rows, Mxi.cols, CV_32F, 0);
-			normal_distr = std::normal_distribution<float>(0, 1);
-			for (int k = 0; k < samples.rows; k++){
-				for (int l = 0; l < samples.cols; l++){
-					samples.at<float>(k, l) = 0;// normal_distr(generator);
+				Mxi = (cradleMat - z_nc_c) * Gmsg;
+				for (int k = 0; k < Mxi.rows; k++){
+					for (int l = 0; l < Mxi.cols; l++){
+						Mxi.at<float>(k, l) = Mxi.at<float>(k, l) + model.kappa_v[i].at<float>(0, l);
+					}
 				}
-			}*/
+				spdSolveRows(U, Mxi, Mxi);	//Mxi = bsxfun(@plus, (z(~x, :) - z_nc(~x, :))*Gmsg, kappa{ i })*Vxi;
 
-			//Get cholesky decomposition of covariance matrix
-			U = Cholesky(Vxi1);
-			cv::invert(U, S);
-			cv::transpose(S, Strans);
+				/*******************
+				* Compute z_c
+				*******************/
+				z_c = Mxi * Gammat;	//xi(~x,:) = Mxi
+				fits += z_c;		//Add cradle-component to the sum
+			}
+			fits /= nsample;
+		}
+		difference = fits;
+	}
 
-			//Get multivariate normal distribution
-			xi = Mxi;// +samples * Strans;
-			// xi(~x,:) = Mxi + normrnd(0,1,[Ncradle,k2])*S';
+	namespace {
+	//Split R-hat of the last 'window' values of 'trace': both halves are treated as separate chains,
+	//so a trace that still drifts within the window is reported as not converged
+	float splitRhat(const std::vector<float> &trace, int window){
+		int n = window / 2;
+		const float *a = trace.data() + trace.size() - 2 * n;
+		const float *b = a + n;
 
-			/*******************
-			* Compute z_c
-			*******************/
-			z_c = xi * Gammat;
-			fits += z_c;		//Add cradle-component to the sum
+		double ma = 0, mb = 0;
+		for (int i = 0; i < n; i++){
+			ma += a[i];
+			mb += b[i];
 		}
-		fits /= nsample;
+		ma /= n;
+		mb /= n;
 
-		//Convert back to coefficient array
-		difference = std::vector<std::vector<float>>(Ncradle);
-		for (int i = 0; i < Ncradle; i++){
-			difference[i] = std::vector<float>(p);
-			for (int j = 0; j < p; j++){
-				difference[i][j] = fits.at<float>(i, j);
-			}
+		double va = 0, vb = 0;
+		for (int i = 0; i < n; i++){
+			va += (a[i] - ma) * (a[i] - ma);
+			vb += (b[i] - mb) * (b[i] - mb);
 		}
+		double W = (va + vb) / (2.0 * (n - 1));				//within-chain variance
+		double B = n * (ma - mb) * (ma - mb) / 2.0;			//between-chain variance
+		if (W <= 0)
+			return B > 0 ? std::numeric_limits<float>::infinity() : 1.f;
+		return std::sqrt(((n - 1.0) / n * W + B / n) / W);
 	}
+	}  // namespace
 
 	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle){
+		gibbs_workspace ws;
+		return gibbsSampling(cradle, noncradle, ws);
+	}
+
+	cradle_model_fitting gibbsSampling(std::vector<std::vector<float>> &cradle, std::vector<std::vector<float>> &noncradle, gibbs_workspace &ws,
+		const gibbs_settings &settings){
 		//Initialize variables used
-		std::default_random_engine generator;
+		PhiloxEngine generator(gibbs_key);
 		std::gamma_distribution<float> gamma_distr;
 		std::normal_distribution<float> normal_distr;
 		std::uniform_real_distribution<double> unif_distr(0.0, 1.0);
 
-		generator.seed(SEED);
+		generator.seek(0, kGibbsInit);
 		int Ncradle = cradle.size();
 		int Nnoncradle = noncradle.size();
 
-		int nrun = 600;
-		int burn = 500;
-		int thin = 1;
-		float sp = (nrun - burn) * 1.0 / thin;
+		int nsamples = std::max(settings.samples, 1);
+		int max_burn = std::max(settings.max_burn, 0);
+		int min_burn = std::min(std::max(settings.min_burn, 0), max_burn);
+		int window = std::max(settings.window, 4);
 
 		int p = cradle[0].size();
 		int k1 = p;
 		int k2 = std::floor(std::log(p) * 3);
 
-		cv::Mat cradleMat(Ncradle, p, CV_32F);
-		cv::Mat noncradleMat(Nnoncradle, p, CV_32F);
+		//A seed model fixes the factor counts; its last draw replaces the prior initialization below
+		const cradle_model_fitting *seed = settings.seed;
+		if (seed && (seed->Lambda_v.empty() || seed->Lambda_v.back().rows != p))
+			seed = nullptr;
+		if (seed){
+			k1 = seed->Lambda_v.back().cols;
+			k2 = seed->Gamma_v.back().cols;
+		}
+
+		cv::Mat &cradleMat = ws.cradleMat;
+		cv::Mat &noncradleMat = ws.noncradleMat;
+		cradleMat.create(Ncradle, p, CV_32F);
+		noncradleMat.create(Nnoncradle, p, CV_32F);
 
 		for (int i = 0; i < Ncradle; i++){
 			for (int j = 0; j < p; j++){
@@ -1040,6 +1298,8 @@ namespace TextureRemoval{
 		for (int i = 0; i < p; i++){
 			ps.at<float>(0, i) = 10;
 		}// ps = 10*ones(p,1);
+		if (seed)
+			seed->ps_v.back().copyTo(ps);
 
 		cv::Mat ps2(1, p, CV_32F);
 		for (int i = 0; i < p; i++){
@@ -1052,6 +1312,8 @@ namespace TextureRemoval{
 		}// Sigma=diag(1./ps);
 
 		cv::Mat lambda(p, k1, CV_32F, cv::Scalar(0));	//Lambda = zeros(p,k1);
+		if (seed)
+			seed->Lambda_v.back().copyTo(lambda);
 
 		cv::Mat psijh1(p, k1, CV_32F);
 		gamma_distr = std::gamma_distribution<float>(df / 2, 2.0 / df);
@@ -1082,10 +1344,10 @@ namespace TextureRemoval{
 			}
 		}// Plam = bsxfun(@times,psijh1,tauh1');
 
-		cv::Mat ttt;
-
 		double rho = mrho;
 		cv::Mat Gamma(p, k2, CV_32F, cv::Scalar(0));
+		if (seed)
+			seed->Gamma_v.back().copyTo(Gamma);
 		cv::Mat psijh2(p, k2, CV_32F);
 		gamma_distr = std::gamma_distribution<float>(df / 2, 2.0 / df);
 		for (int i = 0; i < p; i++){
@@ -1120,6 +1382,8 @@ namespace TextureRemoval{
 		for (int i = 0; i < k2; i++){
 			kappa.at<float>(0, i) = normal_distr(generator);
 		}// kappa = normrnd(0,1,[1,k2]);
+		if (seed)
+			seed->kappa_v.back().copyTo(kappa);
 		
 		cv::Mat xi(Ncradle, k2, CV_32F);
 		for (int i = 0; i < Ncradle; i++){
@@ -1130,132 +1394,124 @@ namespace TextureRemoval{
 		
 		/* End of variable definition/initialization */
 		
-		//Variables used in the loop
-		cv::Mat Lmsg, Lmsgt, Veta, Veta1;
-		cv::Mat Meta;
-		cv::Mat eta_c, eta_nc, eta_nctmp;
-		cv::Mat gammatrans, lambdatrans;
-		cv::Mat eta2_nc, eta_nct, alam;
-		cv::Mat Gmsg, Gmsgt;
-		cv::Mat Vxi, Vxi1, Mxi;
-		cv::Mat xi2, xit, agam;
-		cv::Mat U, S, L, Strans;
+		//Variables used in the loop, kept in the workspace so that their buffers are only
+		//reallocated when a dimension changes (sample counts, or k1/k2 adapted during burn-in)
+		cv::Mat &Lmsg = ws.Lmsg, &Lmsgt = ws.Lmsgt, &Veta1 = ws.Veta1;
+		cv::Mat &prod_nc = ws.prod_nc, &prod_c = ws.prod_c, &prod_xi = ws.prod_xi;
+		cv::Mat eta_c, eta_nc;
+		cv::Mat &eta_nctmp = ws.eta_nctmp, &eta_ctmp = ws.eta_ctmp;
+		cv::Mat &gammatrans = ws.gammatrans, &lambdatrans = ws.lambdatrans;
+		cv::Mat &eta2_nc = ws.eta2_nc, &eta_nct = ws.eta_nct, &alam = ws.alam;
+		cv::Mat &Gmsg = ws.Gmsg, &Gmsgt = ws.Gmsgt;
+		cv::Mat &Vxi1 = ws.Vxi1;
+		cv::Mat &resid = ws.resid, &xi_noise = ws.xi_noise;
+		cv::Mat &xi2 = ws.xi2, &xit = ws.xit, &agam = ws.agam;
+		gibbs_factor &fl = ws.lam, &fg = ws.gam;	//k1 (eta, Lambda) and k2 (xi, Gamma) sized buffers
+		std::vector<float> &tmpsummat = ws.colsum, &lind = ws.lind, &xisum = ws.xisum;
 
 		//Variables used to store results of after-burn iterations
 		cradle_model_fitting fitting;
-		fitting.rho_v = std::vector<float>(nrun - burn);
-		fitting.kappa_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.Gamma_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.xi_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.Lambda_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.ps_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.etac_v = std::vector<cv::Mat>(nrun - burn);
-		fitting.etanc_v = std::vector<cv::Mat>(nrun - burn);
+		fitting.rho_v = std::vector<float>(nsamples);
+		fitting.kappa_v = std::vector<cv::Mat>(nsamples);
+		fitting.Gamma_v = std::vector<cv::Mat>(nsamples);
+		fitting.Lambda_v = std::vector<cv::Mat>(nsamples);
+		fitting.ps_v = std::vector<cv::Mat>(nsamples);
+		if (settings.keep_latent){
+			fitting.xi_v = std::vector<cv::Mat>(nsamples);
+			fitting.etac_v = std::vector<cv::Mat>(nsamples);
+			fitting.etanc_v = std::vector<cv::Mat>(nsamples);
+		}
+
+		//Convergence traces of the burn-in: tr(Lambda*Lambda'), tr(Gamma*Gamma') and the mean noise precision.
+		//None of them depends on k1/k2 (an added column is zero, a dropped one is nearly zero), so the traces
+		//run on across adaptations. rho is held at its prior mean by this sampler, so it is not monitored.
+		std::vector<float> trace_lam, trace_gam, trace_ps;
+		bool burning = max_burn > 0;
+		int burn = 0, kept = 0, iter = 0;
 
 		/*** Start Gibbs sampling ***/
-		for (int iter = 0; iter < nrun; iter++){
+		for (; kept < nsamples; iter++){
+			generator.seek(iter, kGibbsScalars);
 
 			// **** Update eta, non-cradle part  ****
-			Lmsg = cv::Mat(p, k1, CV_32F);
+			Lmsg.create(p, k1, CV_32F);
 			for (int i = 0; i < p; i++){
+				const float *lrow = lambda.ptr<float>(i);
+				float *mrow = Lmsg.ptr<float>(i);
 				for (int j = 0; j < k1; j++){
-					Lmsg.at<float>(i, j) = lambda.at<float>(i, j) * ps.at<float>(0, i);
+					mrow[j] = lrow[j] * ps.at<float>(0, i);
 				}
 			}
 			cv::transpose(Lmsg, Lmsgt);
 			//Lmsg = bsxfun(@times,Lambda,ps);
 
-			Veta1 = Lmsgt * lambda;
+			cv::gemm(Lmsgt, lambda, 1, cv::noArray(), 0, Veta1);
 			for (int i = 0; i < Veta1.rows; i++){
 				Veta1.at<float>(i, i) += 1;	//+eye(k1)
 			}
-			cv::invert(Veta1, Veta);
-
-			U = Cholesky(Veta1);
-			cv::invert(U, S);
-			cv::transpose(S, Strans);
+			Cholesky(Veta1, fl.U);		//Veta = inv(Veta1)
 
 			//Sample eta
-			//Eta mean
-			Meta = noncradleMat * Lmsg * Veta;
+			cv::gemm(noncradleMat, Lmsg, 1, cv::noArray(), 0, prod_nc);
 
 			//Sample zero-mean unit-variance uniform distribution
-			eta_nctmp = cv::Mat(Meta.rows, Meta.cols, CV_32F);
-			normal_distr = std::normal_distribution<float>(0, 1);
-			for (int i = 0; i < eta_nctmp.rows; i++){
-				for (int j = 0; j < eta_nctmp.cols; j++){
-					eta_nctmp.at<float>(i, j) = normal_distr(generator);
-				}
-			}
+			eta_nctmp.create(prod_nc.rows, prod_nc.cols, CV_32F);
+			fillNormal(eta_nctmp, gibbs_key, iter, kGibbsEtaNonCradle);
 			
-			//Get multivariate normal distribution
-			eta_nc = Meta + eta_nctmp * Strans;
+			//Get multivariate normal distribution, mean Meta = noncradleMat*Lmsg*Veta
+			spdSampleRows(fl.U, prod_nc, eta_nctmp, eta_nc);
 			
 			// **** Update eta, cradle part  ****
-			Veta1 = rho * rho * Lmsgt * lambda;
+			cv::gemm(Lmsgt, lambda, rho * rho, cv::noArray(), 0, Veta1);
 			for (int i = 0; i < Veta1.rows; i++){
 				Veta1.at<float>(i, i) += 1;	//+eye(k1)
 			}
-			cv::invert(Veta1, Veta);
-
-			U = Cholesky(Veta1);
-			cv::invert(U, S);
-			cv::transpose(S, Strans);
+			Cholesky(Veta1, fl.U);
 			
 			//Eta mean
 			cv::transpose(Gamma, gammatrans);
-			Meta = (cradleMat - xi * gammatrans) * rho * Lmsg * Veta;
+			cv::gemm(xi, gammatrans, -rho, cradleMat, rho, resid);
+			cv::gemm(resid, Lmsg, 1, cv::noArray(), 0, prod_c);
 			//Meta = (Y(mask,:) - xi*Gamma')*rho*Lmsg*Veta;
 
 			//Sample zero-mean unit-variance uniform distribution
-			eta_nctmp = cv::Mat(Meta.rows, Meta.cols, CV_32F);
-			normal_distr = std::normal_distribution<float>(0, 1);
-			for (int i = 0; i < eta_nctmp.rows; i++){
-				for (int j = 0; j < eta_nctmp.cols; j++){
-					eta_nctmp.at<float>(i, j) = normal_distr(generator);
-				}
-			}
-			//eta_nctmp = TextureRemoval::readMatFromFile("C:/Users/localadmin/Documents/MATLAB/code/platypus_matlab/result/eta_c" + std::to_string(iter + 1) + ".txt", eta_nctmp.rows, eta_nctmp.cols);
+			eta_ctmp.create(prod_c.rows, prod_c.cols, CV_32F);
+			fillNormal(eta_ctmp, gibbs_key, iter, kGibbsEtaCradle);
 
 			//Get multivariate normal distribution
-			eta_c = Meta + eta_nctmp * Strans;
+			spdSampleRows(fl.U, prod_c, eta_ctmp, eta_c);
 			
 			/*** Update beta's --> Do nothing under supervised model ***/
 
 			/*** Update Lambda ***/
 			cv::transpose(eta_nc, eta_nct);
-			eta2_nc = eta_nct*eta_nc;		//eta2 = eta(~mask,:)'*eta(~mask,:);
-			alam = eta_nct * noncradleMat;	//alam = eta(~mask,:)'*Y(~mask,:);
+			cv::gemm(eta_nct, eta_nc, 1, cv::noArray(), 0, eta2_nc);			//eta2 = eta(~mask,:)'*eta(~mask,:);
+			cv::gemm(eta_nct, noncradleMat, 1, cv::noArray(), 0, alam);	//alam = eta(~mask,:)'*Y(~mask,:);
 
 			for (int i = 0; i < p; i++){
-				cv::Mat diagPlam(Plam.cols, Plam.cols, CV_32F, cv::Scalar(0));
+				fl.diagP.create(Plam.cols, Plam.cols, CV_32F);
+				fl.diagP.setTo(0);
 				for (int j = 0; j < Plam.cols; j++){
-					diagPlam.at<float>(j, j) = Plam.at<float>(i, j);
+					fl.diagP.at<float>(j, j) = Plam.at<float>(i, j);
 				}
-				cv::Mat Qlam = diagPlam + ps.at<float>(0, i) * eta2_nc;
+				fl.Q = fl.diagP + ps.at<float>(0, i) * eta2_nc;
 				// Qlam = diag(Plam(j,:)) + ps(j)*eta2;
 
-				cv::Mat blam = ps.at<float>(0, i) * alam(cv::Range(0, alam.rows), cv::Range(i, i + 1));
+				fl.b = ps.at<float>(0, i) * alam(cv::Range(0, alam.rows), cv::Range(i, i + 1));
 				// blam = ps(j)*alam(:,j);
 
 				//Cholesky decomposition
-				L = CholeskyLower(Qlam);
-				cv::Mat Ltransinv, Linv, Ltrans;
-				cv::transpose(L, Ltrans);
-				cv::invert(Ltrans, Ltransinv);
-				cv::invert(L, Linv);
+				Cholesky(fl.Q, fl.U);
 
-				cv::Mat samples(k1, 1, CV_32F, cv::Scalar(0));
+				fl.z.create(1, k1, CV_32F);
 				normal_distr = std::normal_distribution<float>(0, 1);
-				for (int j = 0; j < samples.rows; j++){
-					samples.at<float>(j, 0) = normal_distr(generator);
+				for (int j = 0; j < fl.z.cols; j++){
+					fl.z.at<float>(0, j) = normal_distr(generator);
 				}
-				
-				cv::Mat mvndmat = Ltransinv * Linv * blam + Ltransinv * samples;
 
-				for (int j = 0; j < mvndmat.rows; j++){
-					lambda.at<float>(i, j) = mvndmat.at<float>(j, 0);
-				}//Lambda(i,:) is sampled from multivariate normal distribution with mean inv(Qlam) * blam and covariance matrix inv(Qlam)
+				cv::Mat lrow = lambda.row(i);
+				spdSampleRows(fl.U, fl.b.reshape(1, 1), fl.z, lrow);
+				//Lambda(i,:) is sampled from multivariate normal distribution with mean inv(Qlam) * blam and covariance matrix inv(Qlam)
 			}
 
 			/*** Update psi_{jh}'s ***/
@@ -1272,7 +1528,8 @@ namespace TextureRemoval{
 			}//  psijh1 = gamrnd(df/2 + 0.5,1./(df/2 + bsxfun(@times,Lambda.^2,tauh1')));
 			
 			/*** Update delta & tauh ***/
-			cv::Mat matlocal(lambda.rows, lambda.cols, CV_32F);
+			cv::Mat &matlocal = fl.matlocal;
+			matlocal.create(lambda.rows, lambda.cols, CV_32F);
 			for (int i = 0; i < lambda.rows; i++){
 				for (int j = 0; j < lambda.cols; j++){
 					float tmp = lambda.at<float>(i, j);
@@ -1280,7 +1537,7 @@ namespace TextureRemoval{
 				}
 			}//matlocal = mat = bsxfun(@times,psijh1,Lambda.^2);
 
-			std::vector<float> tmpsummat(tauh1.size());
+			tmpsummat.assign(tauh1.size(), 0);
 			for (int i = 0; i < tauh1.size(); i++){
 				tmpsummat[i] = 0;
 				for (int j = 0; j < matlocal.rows; j++){
@@ -1328,51 +1585,42 @@ namespace TextureRemoval{
 			}
 
 			/*** Update xi, xiz ***/
-			Gmsg = cv::Mat(Gamma.rows, Gamma.cols, CV_32F);
+			Gmsg.create(Gamma.rows, Gamma.cols, CV_32F);
 			for (int i = 0; i < Gamma.rows; i++){
+				const float *grow = Gamma.ptr<float>(i);
+				float *mrow = Gmsg.ptr<float>(i);
 				for (int j = 0; j < Gamma.cols; j++){
-					Gmsg.at<float>(i, j) = Gamma.at<float>(i, j) * ps.at<float>(0, i);
+					mrow[j] = grow[j] * ps.at<float>(0, i);
 				}
 			}//Gmsg = bsxfun(@times, Gamma, ps);
 			cv::transpose(Gmsg, Gmsgt);
 
-			Vxi1 = Gmsgt * Gamma;
+			cv::gemm(Gmsgt, Gamma, 1, cv::noArray(), 0, Vxi1);
 			for (int i = 0; i < Vxi1.cols; i++){
 				Vxi1.at<float>(i, i) = Vxi1.at<float>(i, i) + 1;
 			}//Vxi1 = eye(k2) + Gmsg'*Gamma;
 
-			cv::invert(Vxi1, Vxi);
+			Cholesky(Vxi1, fg.U);	//Vxi = inv(Vxi1)
 			cv::transpose(lambda, lambdatrans);
 
-			Mxi = (cradleMat - rho * eta_c * lambdatrans) * Gmsg * Vxi; // (Y(mask,:) - rho*eta(mask,:)*Lambda')*Gmsg*Vxi
-
-			cv::Mat kappavxi = kappa * Vxi;
-			for (int i = 0; i < Mxi.rows; i++){
-				for (int j = 0; j < Mxi.cols; j++){
-					Mxi.at<float>(i, j) = Mxi.at<float>(i, j) + kappavxi.at<float>(0, j);
+			cv::gemm(eta_c, lambdatrans, -rho, cradleMat, 1, resid);	//Y(mask,:) - rho*eta(mask,:)*Lambda'
+			cv::gemm(resid, Gmsg, 1, cv::noArray(), 0, prod_xi);
+			for (int i = 0; i < prod_xi.rows; i++){
+				float *row = prod_xi.ptr<float>(i);
+				for (int j = 0; j < prod_xi.cols; j++){
+					row[j] += kappa.at<float>(0, j);
 				}
-			}//  Mxi = bsxfun(@plus , (Y(mask,:) - rho*eta(mask,:)*Lambda')*Gmsg*Vxi , kappa*Vxi);
+			}//  Mxi = bsxfun(@plus , (Y(mask,:) - rho*eta(mask,:)*Lambda')*Gmsg , kappa)*Vxi;
 
 			//Sample multivariate normal distribution
-			cv::Mat samples(Mxi.rows, Mxi.cols, CV_32F);
-			normal_distr = std::normal_distribution<float>(0, 1);
-			for (int i = 0; i < samples.rows; i++){
-				for (int j = 0; j < samples.cols; j++){
-					samples.at<float>(i, j) = normal_distr(generator);
-				}
-			}
-			//samples = TextureRemoval::readMatFromFile("C:/Users/localadmin/Documents/MATLAB/code/platypus_matlab/result/xi" + std::to_string(iter + 1) + ".txt", samples.rows, samples.cols);
-
-			//Get cholesky decomposition of covariance matrix
-			U = Cholesky(Vxi1);
-			cv::invert(U, S);
-			cv::transpose(S, Strans);
+			xi_noise.create(prod_xi.rows, prod_xi.cols, CV_32F);
+			fillNormal(xi_noise, gibbs_key, iter, kGibbsXi);
 
 			//Get multivariate normal distribution
-			xi = Mxi + samples * Strans;
+			spdSampleRows(fg.U, prod_xi, xi_noise, xi);
 			
 			/*** Update kappa ***/
-			std::vector<float> xisum(xi.cols);
+			xisum.assign(xi.cols, 0);
 			for (int j = 0; j < xi.cols; j++){
 				for (int i = 0; i < xi.rows; i++){
 					xisum[j] += xi.at<float>(i, j);
@@ -1387,42 +1635,32 @@ namespace TextureRemoval{
 			
 			/*** Update gamma ***/
 			cv::transpose(xi, xit);
-			xi2 = xit * xi;
-			cv::transpose(lambda, lambdatrans);
-			agam = xit * (cradleMat - rho * eta_c * lambdatrans);
+			cv::gemm(xit, xi, 1, cv::noArray(), 0, xi2);
+			cv::gemm(xit, resid, 1, cv::noArray(), 0, agam);	//Lambda and eta are unchanged since resid was formed
 
 			for (int i = 0; i < p; i++){
-				cv::Mat diagPgam(Pgam.cols, Pgam.cols, CV_32F, cv::Scalar(0));
+				fg.diagP.create(Pgam.cols, Pgam.cols, CV_32F);
+				fg.diagP.setTo(0);
 				for (int j = 0; j < Pgam.cols; j++){
-					diagPgam.at<float>(j, j) = Pgam.at<float>(i, j);
+					fg.diagP.at<float>(j, j) = Pgam.at<float>(i, j);
 				}
 
-				cv::Mat Qgam = diagPgam + ps2.at<float>(0, i) * xi2;
-
-				cv::Mat bgam = ps2.at<float>(0, i) * agam(cv::Range(0, agam.rows), cv::Range(i, i + 1));
-				cv::Mat QgamInv;
+				fg.Q = fg.diagP + ps2.at<float>(0, i) * xi2;
 
-				cv::invert(Qgam, QgamInv);
+				fg.b = ps2.at<float>(0, i) * agam(cv::Range(0, agam.rows), cv::Range(i, i + 1));
 
-				//Spectral decomposition
-				L = CholeskyLower(Qgam);
-				cv::Mat Ltransinv, Linv, Ltrans;
-				cv::transpose(L, Ltrans);
-				cv::invert(Ltrans, Ltransinv);
-				cv::invert(L, Linv);
+				//Cholesky decomposition
+				Cholesky(fg.Q, fg.U);
 
-				cv::Mat samples(k2, 1, CV_32F, cv::Scalar(0));
+				fg.z.create(1, k2, CV_32F);
 				normal_distr = std::normal_distribution<float>(0, 1);
-				for (int j = 0; j < samples.rows; j++){
-					samples.at<float>(j, 0) = normal_distr(generator);
+				for (int j = 0; j < fg.z.cols; j++){
+					fg.z.at<float>(0, j) = normal_distr(generator);
 				}
-				//samples = TextureRemoval::readMatFromFile("C:/Users/localadmin/Documents/MATLAB/code/platypus_matlab/result/zlamG" + std::to_string(iter + 1) + "_" + std::to_string(i + 1) + ".txt", samples.rows, samples.cols);
-
-				cv::Mat mvndmat = Ltransinv * Linv * bgam + Ltransinv * samples;
 
-				for (int j = 0; j < mvndmat.rows; j++){
-					Gamma.at<float>(i, j) = mvndmat.at<float>(j, 0);
-				}//Gamma(i,:) is sampled from multivariate normal distribution with mean inv(Qgam) * bgam and covariance matrix inv(Qgam)
+				cv::Mat grow = Gamma.row(i);
+				spdSampleRows(fg.U, fg.b.reshape(1, 1), fg.z, grow);
+				//Gamma(i,:) is sampled from multivariate normal distribution with mean inv(Qgam) * bgam and covariance matrix inv(Qgam)
 			}
 			cv::transpose(Gamma, gammatrans);
 
@@ -1439,19 +1677,20 @@ namespace TextureRemoval{
 			}
 
 			/*** Update delta2 & tauh2 ***/
-			matlocal = cv::Mat(Gamma.rows, Gamma.cols, CV_32F);
+			cv::Mat &matlocal2 = fg.matlocal;
+			matlocal2.create(Gamma.rows, Gamma.cols, CV_32F);
 			for (int i = 0; i < Gamma.rows; i++){
 				for (int j = 0; j < Gamma.cols; j++){
 					float tmp = Gamma.at<float>(i, j);
-					matlocal.at<float>(i, j) = psijh2.at<float>(i, j) * tmp * tmp;
+					matlocal2.at<float>(i, j) = psijh2.at<float>(i, j) * tmp * tmp;
 				}
 			}//mat = bsxfun(@times, psijh2, Gamma. ^ 2);
 
-			tmpsummat = std::vector<float>(tauh2.size());
+			tmpsummat.assign(tauh2.size(), 0);
 			for (int i = 0; i < tauh2.size(); i++){
 				tmpsummat[i] = 0;
-				for (int j = 0; j < matlocal.rows; j++){
-					tmpsummat[i] += matlocal.at<float>(j, i);
+				for (int j = 0; j < matlocal2.rows; j++){
+					tmpsummat[i] += matlocal2.at<float>(j, i);
 				}
 			}// tmpsummat = sum(mat)';
 
@@ -1499,7 +1738,7 @@ namespace TextureRemoval{
 				tauh2[i] = tauh2[i - 1] * delta2[i];
 			}
 
-			Pgam = cv::Mat(p, k2, CV_32F);
+			Pgam.create(p, k2, CV_32F);
 			for (int i = 0; i < p; i++){
 				for (int j = 0; j < k2; j++){
 					Pgam.at<float>(i, j) = psijh2.at<float>(i, j) * tauh2[j];
@@ -1507,7 +1746,7 @@ namespace TextureRemoval{
 			}// Pgam = bsxfun(@times,psijh2,tauh2');
 			
 			/*** Update precision parameters ***/
-			Plam = cv::Mat(p, k1, CV_32F);
+			Plam.create(p, k1, CV_32F);
 			for (int i = 0; i < p; i++){
 				for (int j = 0; j < k1; j++){
 					Plam.at<float>(i, j) = psijh1.at<float>(i, j) * tauh1[j];
@@ -1515,13 +1754,13 @@ namespace TextureRemoval{
 			}// Plam = bsxfun(@times, psijh1, tauh1');
 			
 			//Split, in function of burn reached/not reached
-			if (iter < burn){
+			if (burning){
 				
 				// make adaptations for non - cradle parameters
 				float prob = 1.0 / std::exp(b0 + b1*iter);
 				float uu = unif_distr(generator);
 
-				std::vector<float> lind(lambda.cols);
+				lind.assign(lambda.cols, 0);
 				for (int i = 0; i < lambda.rows; i++){
 					for (int j = 0; j < lambda.cols; j++){
 						if (std::abs(lambda.at<float>(i, j)) < epsilon){
@@ -1687,7 +1926,7 @@ namespace TextureRemoval{
 				prob = 1.0 / std::exp(b0 + b1*iter);
 				uu = unif_distr(generator);
 
-				lind = std::vector<float>(Gamma.cols);
+				lind.assign(Gamma.cols, 0);
 				for (int i = 0; i < Gamma.rows; i++){
 					for (int j = 0; j < Gamma.cols; j++){
 						if (std::abs(Gamma.at<float>(i, j)) < epsilon){
@@ -1846,25 +2085,110 @@ namespace TextureRemoval{
 						}// Pgam = bsxfun(@times,psijh2,tauh2');
 					}
 				}
+
+				//Monitor convergence
+				trace_lam.push_back(cv::norm(lambda, cv::NORM_L2SQR));
+				trace_gam.push_back(cv::norm(Gamma, cv::NORM_L2SQR));
+				trace_ps.push_back(cv::mean(ps)[0]);
+
+				bool converged = false;
+				if (settings.adaptive && (int)trace_lam.size() >= window){
+					fitting.rhat = std::max(splitRhat(trace_lam, window), std::max(splitRhat(trace_gam, window), splitRhat(trace_ps, window)));
+					converged = fitting.rhat < settings.rhat;
+				}
+
+				if (iter + 1 >= max_burn || (iter + 1 >= min_burn && converged)){
+					burning = false;
+					burn = iter + 1;
+				}
 			}
 			else{
 				//After burn period
 				//Save out current matrices
-				fitting.rho_v[iter - burn] = rho;
-				fitting.kappa_v[iter - burn] = kappa.clone();
-				fitting.Gamma_v[iter - burn] = Gamma.clone();
-				fitting.xi_v[iter - burn] = xi.clone();
-				fitting.Lambda_v[iter - burn] = lambda.clone();
-				fitting.ps_v[iter - burn] = ps.clone();
-				fitting.etac_v[iter - burn] = eta_c.clone();
-				fitting.etanc_v[iter - burn] = eta_nc.clone();
+				fitting.rho_v[kept] = rho;
+				fitting.kappa_v[kept] = kappa.clone();
+				fitting.Gamma_v[kept] = Gamma.clone();
+				fitting.Lambda_v[kept] = lambda.clone();
+				fitting.ps_v[kept] = ps.clone();
+				if (settings.keep_latent){
+					fitting.xi_v[kept] = xi.clone();
+					fitting.etac_v[kept] = eta_c.clone();
+					fitting.etanc_v[kept] = eta_nc.clone();
+				}
+				kept++;
 			}
 		}
+		fitting.burn_in = burn;
+		fitting.iterations = iter;
 
 		//Return fitted model
+		foldModel(fitting);
 		return fitting;
 	}
 
+	void foldModel(cradle_model_fitting &model){
+		int nsample = model.Gamma_v.size();
+		if (nsample == 0)
+			return;
+		int p = model.Gamma_v[0].rows;
+
+		//Per draw, the cradle fit of post_inference is
+		//  ((c - rho*c*Lmsg*Veta*Lambda')*Gmsg*Vxi + kappa*Vxi)*Gamma'  =  c*W_i + b_i
+		cv::Mat W(p, p, CV_64F, cv::Scalar(0));
+		cv::Mat b(1, p, CV_64F, cv::Scalar(0));
+		cv::Mat Lmsg, Lmsgt, Veta1, Gammat, lambdat, tmp, U;
+		cv::Mat Gmsg, Gmsgt, Vxi1, LV, GV, KV;
+		for (int i = 0; i < nsample; i++){
+			int k1 = model.Lambda_v[i].cols;
+
+			cv::transpose(model.Gamma_v[i], Gammat);
+			tmp = model.Gamma_v[i] * Gammat;
+			for (int j = 0; j < p; j++){
+				tmp.at<float>(j, j) += 1.0 / model.ps_v[i].at<float>(0, j);
+			}
+			Cholesky(tmp, U);
+			spdSolve(U, model.Lambda_v[i], Lmsg);	//inv(Gamma*Gamma'+diag(1./ps))*Lambda
+			cv::transpose(Lmsg, Lmsgt);
+
+			Veta1 = model.rho_v[i] * model.rho_v[i] * Lmsgt * model.Lambda_v[i];
+			for (int j = 0; j < k1; j++){
+				Veta1.at<float>(j, j) += 1.0;
+			}
+			Cholesky(Veta1, U);
+			spdSolveRows(U, Lmsg, LV);				//Lmsg*Veta
+
+			Gmsg = cv::Mat(p, model.Gamma_v[i].cols, CV_32F);
+			for (int k = 0; k < p; k++){
+				for (int l = 0; l < Gmsg.cols; l++){
+					Gmsg.at<float>(k, l) = model.Gamma_v[i].at<float>(k, l) * model.ps_v[i].at<float>(0, k);
+				}
+			}
+			cv::transpose(Gmsg, Gmsgt);
+			Vxi1 = Gmsgt * model.Gamma_v[i];
+			for (int k = 0; k < Vxi1.cols; k++){
+				Vxi1.at<float>(k, k)++;
+			}
+			Cholesky(Vxi1, U);
+			spdSolveRows(U, Gmsg, GV);				//Gmsg*Vxi
+			spdSolveRows(U, model.kappa_v[i], KV);	//kappa*Vxi
+
+			cv::transpose(model.Lambda_v[i], lambdat);
+			cv::Mat G = GV * Gammat;						//Gmsg*Vxi*Gamma'
+			cv::Mat Wi = G - model.rho_v[i] * LV * lambdat * G;
+			cv::Mat bi = KV * Gammat;
+
+			cv::Mat Wd, bd;
+			Wi.convertTo(Wd, CV_64F);
+			bi.convertTo(bd, CV_64F);
+			W += Wd;
+			b += bd;
+		}
+		W /= nsample;
+		b /= nsample;
+		W.convertTo(model.W, CV_32F);
+		b.convertTo(model.b, CV_32F);
+	}
+
 	void normalizeSamples(std::vector<std::vector<float>> &cradle, std::vector<float> &mean, std::vector<float> &var){
 		int s = cradle[0].size();
 
@@ -1877,6 +2201,17 @@ namespace TextureRemoval{
 		}
 	}
 
+	void normalizeSamples(cv::Mat &cradle, const std::vector<float> &mean, const std::vector<float> &var){
+		CV_Assert(cradle.type() == CV_32F && cradle.cols == mean.size());
+		for (int j = 0; j < cradle.rows; j++){
+			float *c = cradle.ptr<float>(j);
+			for (int i = 0; i < cradle.cols; i++){
+				if (var[i] != 0)
+					c[i] = (c[i] - mean[i]) / var[i];
+			}
+		}
+	}
+
 	void normalizeNonCradle(std::vector<std::vector<float>> &noncradle, std::vector<float> &mean, std::vector<float> &var){
 		int s = noncradle[0].size();
 
@@ -1926,6 +2261,17 @@ namespace TextureRemoval{
 		}
 	}
 
+	void unNormalizeSamples(cv::Mat &cradle, const std::vector<float> &mean, const std::vector<float> &var){
+		CV_Assert(cradle.type() == CV_32F && cradle.cols == var.size());
+		for (int j = 0; j < cradle.rows; j++){
+			float *c = cradle.ptr<float>(j);
+			for (int i = 0; i < cradle.cols; i++){
+				if (var[i] != 0)
+					c[i] = c[i] * var[i];
+			}
+		}
+	}
+
 	void unNormalizeSamplesCrossSection(std::vector<std::vector<float>> &cradle, std::vector<float> &meanh, std::vector<float> &varh, std::vector<float> &meanv, std::vector<float> &varv){
 		int s = cradle[0].size() / 2;
 
@@ -1946,6 +2292,43 @@ namespace TextureRemoval{
 		}
 	}
 
+	std::array<uint32_t, 4> PhiloxEngine::block(uint64_t key, std::array<uint32_t, 4> c){
+		uint32_t k0 = uint32_t(key), k1 = uint32_t(key >> 32);
+		for (int round = 0; round < 10; round++){
+			uint64_t p0 = uint64_t(0xD2511F53u) * c[0];
+			uint64_t p1 = uint64_t(0xCD9E8D57u) * c[2];
+			c = { { uint32_t(p1 >> 32) ^ c[1] ^ k0, uint32_t(p1), uint32_t(p0 >> 32) ^ c[3] ^ k1, uint32_t(p0) } };
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+		return c;
+	}
+
+	void SampleReservoir::add(const float *f, uint64_t priority){
+		if (heap.size() < capacity){
+			heap.emplace_back(priority, heap.size());
+			data.insert(data.end(), f, f + dim);
+			std::push_heap(heap.begin(), heap.end());
+			return;
+		}
+		//Replace the kept sample of largest priority
+		if (priority >= heap.front().first)
+			return;
+		std::pop_heap(heap.begin(), heap.end());
+		heap.back().first = priority;
+		std::copy(f, f + dim, data.begin() + heap.back().second * dim);
+		std::push_heap(heap.begin(), heap.end());
+	}
+
+	std::vector<std::vector<float>> SampleReservoir::samples() const{
+		std::vector<std::pair<uint64_t, size_t>> order = heap;
+		std::sort(order.begin(), order.end());
+		std::vector<std::vector<float>> res(order.size());
+		for (size_t i = 0; i < res.size(); i++)
+			res[i].assign(data.begin() + order[i].second * dim, data.begin() + (order[i].second + 1) * dim);
+		return res;
+	}
+
 	void sampleDataset(std::vector<std::vector<float>> &dts, std::vector<std::vector<float>> &samples, int cnt){
 		//Check if empty
 		if (dts.size() == 0){
@@ -1982,12 +2365,371 @@ namespace TextureRemoval{
 		}
 	}
 
+	void fillNormal(cv::Mat &m, uint64_t key, uint32_t c1, uint32_t c2){
+		CV_Assert(m.type() == CV_32F);
+		#pragma omp parallel for
+		for (int i = 0; i < m.rows; i++){
+			float *row = m.ptr<float>(i);
+			for (int j = 0; j < m.cols; j += 4){
+				std::array<uint32_t, 4> r = PhiloxEngine::block(key, { { uint32_t(j / 4), uint32_t(i), c1, c2 } });
+
+				//Box-Muller on both pairs of words
+				for (int l = 0; l < 4 && j + l < m.cols; l += 2){
+					double u1 = (r[l] + 1.0) / 4294967296.0;	//(0, 1]
+					double u2 = r[l + 1] / 4294967296.0;
+					double radius = std::sqrt(-2 * std::log(u1));
+					row[j + l] = radius * std::cos(2 * PI * u2);
+					if (j + l + 1 < m.cols)
+						row[j + l + 1] = radius * std::sin(2 * PI * u2);
+				}
+			}
+		}
+	}
+
+	void knnInterpolate(const cv::Mat &queries, const cv::Mat &points, const cv::Mat &values, int k, cv::Mat &out){
+		CV_Assert(queries.type() == CV_32F && points.type() == CV_32F && values.type() == CV_32F);
+		CV_Assert(queries.cols == points.cols && values.rows == points.rows && k > 0 && k <= points.rows);
+		const int tile = 128;		//Queries per distance tile, keeps the tile in cache for a few thousand points
+		int n = points.rows;
+
+		cv::Mat pnorm;
+		cv::reduce(points.mul(points), pnorm, 1, cv::REDUCE_SUM);
+
+		out.create(queries.rows, values.cols, CV_32F);
+		cv::Mat dist, qnorm;
+		std::vector<float> best_d(k);
+		std::vector<int> best_i(k);
+		std::vector<double> acc(values.cols);
+		for (int t = 0; t < queries.rows; t += tile){
+			cv::Mat q = queries.rowRange(t, std::min(t + tile, queries.rows));
+
+			//Squared distances |q|^2 + |p|^2 - 2 q.p of the whole tile, the product on the GEMM kernel
+			cv::gemm(q, points, -2, cv::noArray(), 0, dist, cv::GEMM_2_T);
+			cv::reduce(q.mul(q), qnorm, 1, cv::REDUCE_SUM);
+
+			for (int i = 0; i < q.rows; i++){
+				const float *drow = dist.ptr<float>(i);
+				const float *pn = pnorm.ptr<float>();
+				float qn = qnorm.at<float>(i, 0);
+
+				//Top-k by insertion into a sorted list of k entries
+				int found = 0;
+				for (int j = 0; j < n; j++){
+					float d = std::max(drow[j] + qn + pn[j], 0.f);
+					if (found == k && d >= best_d[k - 1])
+						continue;
+					int pos = found < k ? found++ : k - 1;
+					while (pos > 0 && best_d[pos - 1] > d){
+						best_d[pos] = best_d[pos - 1];
+						best_i[pos] = best_i[pos - 1];
+						pos--;
+					}
+					best_d[pos] = d;
+					best_i[pos] = j;
+				}
+
+				//Inverse distance weighting of the neighbours' values
+				std::fill(acc.begin(), acc.end(), 0.0);
+				double sumweight = 0;
+				for (int m = 0; m < k; m++){
+					double w = 1.0 / (1 + best_d[m]);
+					const float *v = values.ptr<float>(best_i[m]);
+					for (int l = 0; l < values.cols; l++)
+						acc[l] += w * v[l];
+					sumweight += w;
+				}
+				float *o = out.ptr<float>(t + i);
+				for (int l = 0; l < values.cols; l++)
+					o[l] = acc[l] / sumweight;
+			}
+		}
+	}
+
+	std::string defaultCacheDirectory(){
+		std::string base;
+#ifdef _WIN32
+		if (const char *local = std::getenv("LOCALAPPDATA"))
+			base = local;
+#else
+		const char *home = std::getenv("HOME");
+#ifdef __APPLE__
+		if (home && *home)
+			base = std::string(home) + "/Library/Caches";
+#else
+		if (const char *xdg = std::getenv("XDG_CACHE_HOME"))
+			base = xdg;
+		if (base.empty() && home && *home)
+			base = std::string(home) + "/.cache";
+#endif
+#endif
+		return base.empty() ? std::string() : base + "/platypus";
+	}
+
+	bool supportedBlockSize(int size){
+		return size == 256 || size == 512 || size == 1024;
+	}
+
+	bool validBlockLayout(const block_layout &layout){
+		return supportedBlockSize(layout.size) && layout.overlap >= 0 && layout.overlap % 2 == 0 && 2 * layout.overlap < layout.size;
+	}
+
+	bool saveModel(const cradle_model_fitting &model, const std::string &path){
+		//Written aside and moved into place, so concurrent runs never read a partial model
+		std::string tmp = path + "." + std::to_string(std::random_device()()) + ".tmp";
+		{
+			std::ofstream file(tmp, std::ios::binary);
+			file.write(model_magic, sizeof(model_magic));
+			file.write((const char *)&model_format, sizeof(int));
+			file.write((const char *)&model.burn_in, sizeof(int));
+			file.write((const char *)&model.iterations, sizeof(int));
+			file.write((const char *)&model.rhat, sizeof(float));
+
+			int count = model.rho_v.size();
+			file.write((const char *)&count, sizeof(int));
+			file.write((const char *)model.rho_v.data(), count * sizeof(float));
+			writeMats(file, model.kappa_v);
+			writeMats(file, model.Gamma_v);
+			writeMats(file, model.Lambda_v);
+			writeMats(file, model.ps_v);
+			writeMat(file, model.W);
+			writeMat(file, model.b);
+			if (!file){
+				file.close();
+				std::remove(tmp.c_str());
+				return false;
+			}
+		}
+		if (std::rename(tmp.c_str(), path.c_str()) != 0){
+			std::remove(path.c_str());
+			if (std::rename(tmp.c_str(), path.c_str()) != 0){
+				std::remove(tmp.c_str());
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool loadModel(const std::string &path, cradle_model_fitting &model){
+		std::ifstream file(path, std::ios::binary);
+		char magic[4];
+		int format = 0;
+		file.read(magic, sizeof(magic));
+		file.read((char *)&format, sizeof(int));
+		if (!file || !std::equal(magic, magic + 4, model_magic) || format != model_format)
+			return false;
+
+		cradle_model_fitting res;
+		int count = -1;
+		file.read((char *)&res.burn_in, sizeof(int));
+		file.read((char *)&res.iterations, sizeof(int));
+		file.read((char *)&res.rhat, sizeof(float));
+		file.read((char *)&count, sizeof(int));
+		if (!file || count < 0 || count > (1 << 20))
+			return false;
+		res.rho_v.resize(count);
+		file.read((char *)res.rho_v.data(), count * sizeof(float));
+		if (!readMats(file, res.kappa_v, count) || !readMats(file, res.Gamma_v, count) ||
+			!readMats(file, res.Lambda_v, count) || !readMats(file, res.ps_v, count) ||
+			!readMat(file, res.W) || !readMat(file, res.b))
+			return false;
+
+		model = std::move(res);
+		return true;
+	}
+
+	void interleaveSubbands(const std::vector<cv::Mat> &coeffs, const int *target, cv::Size size, int rstep, int cstep, cv::Mat &features){
+		int rows = (size.height + rstep - 1) / rstep;
+		int cols = (size.width + cstep - 1) / cstep;
+		features.create(rows * cols, target_dim, CV_32F);
+
+		//One subband at a time: sequential reads, writes strided by target_dim
+		int lindex = 0;
+		for (int l = 0; l < 61; l++) if (target[l] == 1){
+			for (int i = 0; i < rows; i++){
+				const float *src = coeffs[l].ptr<float>(i * rstep);
+				float *dst = features.ptr<float>(i * cols) + lindex;
+				for (int j = 0; j < cols; j++){
+					dst[j * target_dim] = src[j * cstep];
+				}
+			}
+			lindex++;
+		}
+	}
+
+	void deinterleaveSubbands(const cv::Mat &features, const int *target, cv::Size size, int rstep, int cstep, std::vector<cv::Mat> &coeffs){
+		int rows = (size.height + rstep - 1) / rstep;
+		int cols = (size.width + cstep - 1) / cstep;
+		CV_Assert(features.rows == rows * cols && features.cols == target_dim && features.isContinuous());
+
+		int lindex = 0;
+		for (int l = 0; l < 61; l++) if (target[l] == 1){
+			for (int i = 0; i < rows; i++){
+				const float *src = features.ptr<float>(i * cols) + lindex;
+				float *dst = coeffs[l].ptr<float>(i * rstep);
+				for (int j = 0; j < cols; j++){
+					dst[j * cstep] = src[j * target_dim];
+				}
+			}
+			lindex++;
+		}
+	}
+
+	namespace {
+	//Frequency response of each FFST subband. The filters are real and symmetric, so the transform is a
+	//circular convolution per subband, and its spectrum is the DFT of the coefficients of a unit impulse.
+	const std::vector<cv::Mat> &ffstSpectra(){
+		static std::vector<cv::Mat> spectra;
+		static std::once_flag once;
+		std::call_once(once, []{
+			cv::Mat impulse(transform_size, transform_size, CV_32F, cv::Scalar(0));
+			impulse.at<float>(0, 0) = 1;
+			std::vector<cv::Mat> response = FFST::shearletTransformSpect(impulse);
+			spectra.resize(response.size());
+			for (int l = 0; l < response.size(); l++){
+				cv::Mat spectrum;
+				cv::dft(response[l], spectrum, cv::DFT_COMPLEX_OUTPUT);
+				cv::extractChannel(spectrum, spectra[l], 0);
+			}
+		});
+		return spectra;
+	}
+
+	//Subband responses for 'size' x 'size' blocks. The FFST bank is only tabulated for 512; other sizes sample
+	//its responses at their own DFT frequencies (every other one for 256, linearly interpolated in between for
+	//1024) and renormalise them so the squared responses sum to one. The transform is then a Parseval frame,
+	//inverted by filtering every subband once more and summing.
+	const std::vector<cv::Mat> &shearletSpectra(int size){
+		CV_Assert(supportedBlockSize(size));
+		if (size == transform_size)
+			return ffstSpectra();
+
+		static std::mutex lock;
+		static std::map<int, std::vector<cv::Mat>> banks;
+		std::lock_guard<std::mutex> guard(lock);
+		std::vector<cv::Mat> &spectra = banks[size];
+		if (!spectra.empty())
+			return spectra;
+
+		//Position of each DFT frequency of 'size' on the tabulated grid
+		const std::vector<cv::Mat> &base = ffstSpectra();
+		std::vector<int> lo(size), hi(size);
+		std::vector<float> frac(size);
+		for (int k = 0; k < size; k++){
+			double pos = double(k) * transform_size / size;
+			lo[k] = int(pos);
+			hi[k] = (lo[k] + 1) % transform_size;
+			frac[k] = float(pos - lo[k]);
+		}
+
+		std::vector<cv::Mat> bank(base.size());
+		cv::Mat energy(size, size, CV_32F, cv::Scalar(0));
+		for (int l = 0; l < base.size(); l++){
+			bank[l].create(size, size, CV_32F);
+			for (int i = 0; i < size; i++){
+				const float *r0 = base[l].ptr<float>(lo[i]);
+				const float *r1 = base[l].ptr<float>(hi[i]);
+				float *h = bank[l].ptr<float>(i);
+				for (int j = 0; j < size; j++){
+					float top = r0[lo[j]] + frac[j] * (r0[hi[j]] - r0[lo[j]]);
+					float bottom = r1[lo[j]] + frac[j] * (r1[hi[j]] - r1[lo[j]]);
+					h[j] = top + frac[i] * (bottom - top);
+				}
+			}
+			energy += bank[l].mul(bank[l]);
+		}
+		cv::sqrt(energy, energy);
+		energy.setTo(1, energy == 0);
+		for (auto &h : bank)
+			cv::divide(h, energy, h);
+		spectra.swap(bank);
+		return spectra;
+	}
+	}  // namespace
+
+	std::vector<cv::Mat> shearletTransform(const cv::Mat &block, const std::vector<bool> &subbands){
+		CV_Assert(block.type() == CV_32F && block.rows == block.cols);
+		const std::vector<cv::Mat> &spectra = shearletSpectra(block.rows);
+		CV_Assert(subbands.empty() || subbands.size() == spectra.size());
+
+		//One forward DFT of the block, then a product and an inverse DFT per computed subband
+		cv::Mat spectrum, product;
+		cv::dft(block, spectrum, cv::DFT_COMPLEX_OUTPUT);
+		std::vector<cv::Mat> coeffs(spectra.size());
+		for (int l = 0; l < spectra.size(); l++) if (subbands.empty() || subbands[l]){
+			product.create(spectrum.size(), CV_32FC2);
+			for (int i = 0; i < spectrum.rows; i++){
+				const cv::Vec2f *s = spectrum.ptr<cv::Vec2f>(i);
+				const float *h = spectra[l].ptr<float>(i);
+				cv::Vec2f *p = product.ptr<cv::Vec2f>(i);
+				for (int j = 0; j < spectrum.cols; j++){
+					p[j][0] = s[j][0] * h[j];
+					p[j][1] = s[j][1] * h[j];
+				}
+			}
+			cv::dft(product, coeffs[l], cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+		}
+		return coeffs;
+	}
+
+	cv::Mat inverseShearletTransform(std::vector<cv::Mat> &coeffs){
+		CV_Assert(!coeffs.empty() && coeffs[0].type() == CV_32F && coeffs[0].rows == coeffs[0].cols);
+		if (coeffs[0].rows == transform_size)
+			return FFST::inverseShearletTransformSpect(coeffs);
+
+		//Parseval frame: filter each subband once more and sum the spectra
+		const std::vector<cv::Mat> &spectra = shearletSpectra(coeffs[0].rows);
+		CV_Assert(coeffs.size() == spectra.size());
+		cv::Mat sum(spectra[0].size(), CV_32FC2, cv::Scalar::all(0)), spectrum, img;
+		for (int l = 0; l < spectra.size(); l++){
+			cv::dft(coeffs[l], spectrum, cv::DFT_COMPLEX_OUTPUT);
+			for (int i = 0; i < spectrum.rows; i++){
+				const cv::Vec2f *s = spectrum.ptr<cv::Vec2f>(i);
+				const float *h = spectra[l].ptr<float>(i);
+				cv::Vec2f *o = sum.ptr<cv::Vec2f>(i);
+				for (int j = 0; j < spectrum.cols; j++){
+					o[j][0] += s[j][0] * h[j];
+					o[j][1] += s[j][1] * h[j];
+				}
+			}
+		}
+		cv::dft(sum, img, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+		return img;
+	}
+
+	void reconstructBlock(std::vector<cv::Mat> &coeffs, int sx, int sy, int csx, int csy, int cex, int cey,
+		const cv::Rect &inner, std::pair<cv::Rect, cv::Mat> &part, std::vector<std::pair<cv::Rect, cv::Mat>> &deferred){
+
+		//Reconstruct coefficients
+		cv::Mat img = inverseShearletTransform(coeffs);
+		cv::Point origin(sy, sx);
+		cv::Rect centre(cv::Point(csy, csx), cv::Point(cey, cex));
+		cv::Rect direct = inner & centre;
+		if (direct.area() == 0){
+			part = std::make_pair(cv::Rect(), cv::Mat());
+			deferred.emplace_back(centre, img(centre - origin).clone());
+			return;
+		}
+		part = std::make_pair(direct, img(direct - origin));
+
+		//Strips of the centre around the directly written part: above, below, left and right of it
+		cv::Rect strips[] = {
+			cv::Rect(centre.tl(), cv::Point(centre.br().x, direct.y)),
+			cv::Rect(cv::Point(centre.x, direct.br().y), centre.br()),
+			cv::Rect(cv::Point(centre.x, direct.y), cv::Point(direct.x, direct.br().y)),
+			cv::Rect(cv::Point(direct.br().x, direct.y), cv::Point(centre.br().x, direct.br().y))
+		};
+		for (const cv::Rect &strip : strips){
+			if (strip.area() > 0)
+				deferred.emplace_back(strip, img(strip - origin).clone());
+		}
+	}
+
 	void reconstructBlock(cv::Mat &texture, std::vector<cv::Mat> &coeffs, int sx, int sy, int csx, int csy, int cex, int cey){
 
 		cv::Mat img;
 
 		//Reconstruct coefficients
-		img = FFST::inverseShearletTransformSpect(coeffs);
+		img = inverseShearletTransform(coeffs);
 		
 		//Copy pixels to right location
 		for (int j = csx - sx; j < cex - sx; j++){
@@ -1997,6 +2739,31 @@ namespace TextureRemoval{
 		}
 	}
 
+	namespace {
+	//x <- x * inv(U), forward substitution on one row (U upper triangular)
+	void rowSolveU(const cv::Mat &U, float *x){
+		int k = U.rows;
+		for (int j = 0; j < k; j++){
+			double sum = x[j];
+			for (int i = 0; i < j; i++)
+				sum -= x[i] * U.at<float>(i, j);
+			x[j] = sum / U.at<float>(j, j);
+		}
+	}
+
+	//x <- x * inv(U)', back substitution on one row
+	void rowSolveUt(const cv::Mat &U, float *x){
+		int k = U.rows;
+		for (int j = k - 1; j >= 0; j--){
+			const float *u = U.ptr<float>(j);
+			double sum = x[j];
+			for (int i = j + 1; i < k; i++)
+				sum -= u[i] * x[i];
+			x[j] = sum / u[j];
+		}
+	}
+	}  // namespace
+
 	std::vector<float> mvnpdf(std::vector<std::vector<float>> &X, std::vector<float> &mean, cv::Mat &covar){
 		int n = X.size();
 		int d = X[0].size();
@@ -2010,11 +2777,11 @@ namespace TextureRemoval{
 		}
 
 		//Decompose covariance
-		cv::Mat invR, R = Cholesky(covar);
-		cv::invert(R, invR);
+		cv::Mat R = Cholesky(covar);
 
-		//Create standardized data
-		X0 = X0 * invR;
+		//Create standardized data X0 * inv(R)
+		for (int i = 0; i < n; i++)
+			rowSolveU(R, X0.ptr<float>(i));
 
 		//logSqrtDetSigma = sum(log(diag(R)));
 		float logSqrtDetSigma = 0;
@@ -2054,11 +2821,11 @@ namespace TextureRemoval{
 		}
 
 		//Decompose covariance
-		cv::Mat invR, R = Cholesky(covar);
-		cv::invert(R, invR);
+		cv::Mat R = Cholesky(covar);
 
-		//Create standardized data
-		X0 = X0 * invR;
+		//Create standardized data X0 * inv(R)
+		for (int i = 0; i < n; i++)
+			rowSolveU(R, X0.ptr<float>(i));
 
 		//logSqrtDetSigma = sum(log(diag(R)));
 		float logSqrtDetSigma = 0;
@@ -2087,10 +2854,16 @@ namespace TextureRemoval{
 
 	/* Calculates upper triangular matrix S, where A is a symmetrical matrix A=S'*S */
 	cv::Mat Cholesky(cv::Mat &A){
+		cv::Mat S;
+		Cholesky(A, S);
+		return S;
+	}
+
+	void Cholesky(const cv::Mat &A, cv::Mat &S){
 		CV_Assert(A.type() == CV_32F);
 
 		int dim = A.rows;
-		cv::Mat S(dim, dim, CV_32F);
+		S.create(dim, dim, CV_32F);
 
 		int i, j, k;
 
@@ -2118,8 +2891,6 @@ namespace TextureRemoval{
 				S.at<float>(i, j) = (A.at<float>(i, j) - sum)*ival;
 			}
 		}
-
-		return S;
 	}
 
 	cv::Mat CholeskyLower(cv::Mat &A){
@@ -2128,4 +2899,43 @@ namespace TextureRemoval{
 		cv::transpose(U, L);
 		return L;
 	}
+
+	void CholeskyLower(const cv::Mat &A, cv::Mat &L){
+		Cholesky(A, L);
+		cv::transpose(L, L);
+	}
+
+	void spdSolveRows(const cv::Mat &U, const cv::Mat &B, cv::Mat &X){
+		CV_Assert(U.type() == CV_32F && B.type() == CV_32F && B.cols == U.rows);
+		if (X.data != B.data)
+			B.copyTo(X);
+		for (int i = 0; i < X.rows; i++){
+			float *x = X.ptr<float>(i);
+			rowSolveU(U, x);
+			rowSolveUt(U, x);
+		}
+	}
+
+	void spdSampleRows(const cv::Mat &U, const cv::Mat &B, const cv::Mat &Z, cv::Mat &X){
+		CV_Assert(U.type() == CV_32F && B.type() == CV_32F && Z.type() == CV_32F);
+		CV_Assert(B.size() == Z.size() && B.cols == U.rows);
+		if (X.data != B.data)
+			B.copyTo(X);
+		for (int i = 0; i < X.rows; i++){
+			float *x = X.ptr<float>(i);
+			const float *z = Z.ptr<float>(i);
+			rowSolveU(U, x);
+			for (int j = 0; j < X.cols; j++)
+				x[j] += z[j];
+			rowSolveUt(U, x);
+		}
+	}
+
+	void spdSolve(const cv::Mat &U, const cv::Mat &B, cv::Mat &X){
+		//inv(A)*B = (B'*inv(A))' for symmetric A
+		cv::Mat Bt;
+		cv::transpose(B, Bt);
+		spdSolveRows(U, Bt, Bt);
+		cv::transpose(Bt, X);
+	}
 }
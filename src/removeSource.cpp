@@ -2,6 +2,7 @@
 #include <imageManager.h>
 #include <project.h>
 #include <polygon.h>
+#include <algorithm>
 #include <cmath>
 
 RemoveSource::RemoveSource(QObject *parent) : ImageSource(parent), m_bypass(false), m_project(nullptr), m_final(false)
@@ -42,6 +43,31 @@ void RemoveSource::setIsFinal(bool final)
 	}
 }
 
+void RemoveSource::updateRegion(const QRect &rect, const cv::Mat &pixels)
+{
+	{
+		QMutexLocker lock(&m_previewLock);
+		if (m_preview.empty())
+			m_preview.create(size().height(), size().width(), CV_8U);
+		cv::Rect roi(rect.left(), rect.top(), rect.width(), rect.height());
+		cv::convertScaleAbs(pixels, m_preview(roi));
+		m_previewed += rect;
+	}
+	invalidate();
+}
+
+void RemoveSource::clearRegions()
+{
+	{
+		QMutexLocker lock(&m_previewLock);
+		if (m_preview.empty())
+			return;
+		m_preview.release();
+		m_previewed = QRegion();
+	}
+	invalidate();
+}
+
 QSize RemoveSource::size() const
 {
 	return ImageManager::get().source()->size();
@@ -72,6 +98,16 @@ QImage RemoveSource::getTile(const QRect &tile, const QSize &size) const
 	cv::Mat cradleWrap(tile.height(), tile.width(), CV_32F, (void *)iplImageRow<float>(cradle, tile.top(), tile.left()), cradle->widthStep);
 	cv::convertScaleAbs(cradleWrap, converted);
 
+	// overlay the parts already finished by a running removal
+	{
+		QMutexLocker lock(&m_previewLock);
+		for (const QRect &r : m_previewed.intersected(tile))
+		{
+			cv::Rect part(r.left(), r.top(), r.width(), r.height());
+			m_preview(part).copyTo(converted(part - roi.tl()));
+		}
+	}
+
 	// resize
 	QImage result(size, QImage::Format_Indexed8);
     result.setColorCount(256);
@@ -97,8 +133,11 @@ QImage RemoveSource::getTile(const QRect &tile, const QSize &size) const
     }
     else
     {
-        std::vector<QRgb> table(polygons.size());
-        std::fill(table.begin(), table.end(), defPixel);
+        // empty pieces have no polygon, so the table is sized by the largest piece index
+        int pieces = 0;
+        for (auto p : polygons)
+            pieces = std::max(pieces, p->value("index").toInt() + 1);
+        std::vector<QRgb> table(pieces, defPixel);
         for (auto p : polygons)
         {
             int index = p->value("index").toInt();
@@ -121,7 +160,7 @@ QImage RemoveSource::getTile(const QRect &tile, const QSize &size) const
             while (mrow != end)
             {
                 unsigned short v = *srow;
-                *mrow = v == 0 ? defPixel : table[v - 1];
+                *mrow = v == 0 || v > table.size() ? defPixel : table[v - 1];
                 srow++;
                 mrow++;
             }
@@ -3,6 +3,8 @@
 
 #include <imageSource.h>
 #include <cvImage.h>
+#include <QtCore/QMutex>
+#include <QtGui/QRegion>
 
 class Project;
 
@@ -23,6 +25,10 @@ public:
 	void setBypass(bool bypass);
     void setIsFinal(bool final);
 
+    // intermediate result shown over 'rect' until the previews are cleared
+    void updateRegion(const QRect &rect, const cv::Mat &pixels);
+    void clearRegions();
+
     bool isFinal() const { return m_final; }
 
 Q_SIGNALS:
@@ -34,6 +40,10 @@ private:
 	bool m_bypass;
     bool m_final;
 
+    mutable QMutex m_previewLock;
+    cv::Mat m_preview;      // 8 bit previews, allocated on the first update
+    QRegion m_previewed;
+
 private slots:
 };
 
@@ -3,9 +3,13 @@
 #include <gtest/gtest.h>
 
 #include <platypus/CradleFunctions.h>
+#include <platypus/FFST.h>
 #include <platypus/TextureRemoval.h>
 
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
+#include <limits>
 
 namespace {
 
@@ -28,15 +32,41 @@ cv::Mat MakeSyntheticTextureImage(int rows = 64, int cols = 64) {
   return image;
 }
 
-CradleFunctions::MarkedSegments MakeSegmentLayout(const cv::Size& size) {
-  CradleFunctions::MarkedSegments segments;
-  segments.pieces = 2;
-  segments.piece_mask = cv::Mat(size, CV_16U, cv::Scalar(0));
-  segments.piece_middle.push_back(cv::Point2i(size.width / 2, size.height / 2));
-  segments.piece_type.push_back(CradleFunctions::VERTICAL_DIR);
-  segments.pieceIDh = {};
-  segments.pieceIDv = {{1}};
-  return segments;
+// Per-draw cradle fit of post_inference() as computed before the non-cradle and noise terms were
+// dropped: explicit inverses, the same formulas draw by draw
+std::vector<std::vector<float>> ReferencePerDrawFit(const TextureRemoval::cradle_model_fitting& model,
+                                                    const std::vector<std::vector<float>>& cradle) {
+  const int n = static_cast<int>(cradle.size());
+  const int p = static_cast<int>(cradle[0].size());
+  cv::Mat z(n, p, CV_32F);
+  for (int i = 0; i < n; ++i) std::copy(cradle[i].begin(), cradle[i].end(), z.ptr<float>(i));
+
+  cv::Mat fits(n, p, CV_32F, cv::Scalar(0));
+  for (size_t i = 0; i < model.Gamma_v.size(); ++i) {
+    const cv::Mat& lambda = model.Lambda_v[i];
+    const cv::Mat& gamma = model.Gamma_v[i];
+    const cv::Mat& ps = model.ps_v[i];
+    const float rho = model.rho_v[i];
+
+    cv::Mat covariance = gamma * gamma.t();
+    for (int j = 0; j < p; ++j) covariance.at<float>(j, j) += 1.0f / ps.at<float>(0, j);
+    cv::Mat lmsg = covariance.inv() * lambda;
+    cv::Mat veta1 = rho * rho * lmsg.t() * lambda + cv::Mat::eye(lambda.cols, lambda.cols, CV_32F);
+    cv::Mat eta_c = z * lmsg * veta1.inv();
+    cv::Mat z_nc_c = eta_c * lambda.t() * rho;
+
+    cv::Mat gmsg = gamma.clone();
+    for (int k = 0; k < p; ++k) gmsg.row(k) *= ps.at<float>(0, k);
+    cv::Mat vxi1 = gmsg.t() * gamma + cv::Mat::eye(gamma.cols, gamma.cols, CV_32F);
+    cv::Mat vxi = vxi1.inv();
+    cv::Mat mxi = (z - z_nc_c) * gmsg * vxi + cv::repeat(model.kappa_v[i] * vxi, n, 1);
+    fits += mxi * gamma.t();
+  }
+  fits /= static_cast<double>(model.Gamma_v.size());
+
+  std::vector<std::vector<float>> res(n);
+  for (int i = 0; i < n; ++i) res[i].assign(fits.ptr<float>(i), fits.ptr<float>(i) + p);
+  return res;
 }
 
 }  // namespace
@@ -54,6 +84,125 @@ TEST(PlatypusBackend, CradleDetectFindsMembersOnFixture) {
   ExpectValidRanges(hrange, image.rows);
 }
 
+TEST(PlatypusBackend, SmoothingCacheMatchesBoxFilters) {
+  cv::Mat image = MakeSyntheticTextureImage(40, 56);
+  CradleFunctions::SmoothingCache smoothing(image);
+
+  for (int ksize : {3, 4, 7}) {
+    const float w = 1.0f / ksize;
+    cv::Mat vertical;
+    cv::Mat horizontal;
+    cv::Mat box;
+    cv::filter2D(image, vertical, CV_32F, cv::Mat(ksize, 1, CV_32F, cv::Scalar(w)));
+    cv::filter2D(image, horizontal, CV_32F, cv::Mat(1, ksize, CV_32F, cv::Scalar(w)));
+    cv::filter2D(image, box, CV_32F, cv::Mat(ksize, ksize, CV_32F, cv::Scalar(w * w)));
+
+    // float rounding of a ksize x ksize window sum, relative to the smoothed value
+    auto tolerance = [](float expected) { return 1e-5 * (std::abs(expected) + 1.0); };
+    for (int row = 0; row < image.rows; ++row) {
+      for (int col = 0; col < image.cols; ++col) {
+        const float v = vertical.at<float>(row, col);
+        const float h = horizontal.at<float>(row, col);
+        const float b = box.at<float>(row, col);
+        EXPECT_NEAR(smoothing.vertical(ksize).at(row, col), v, tolerance(v));
+        EXPECT_NEAR(smoothing.horizontal(ksize).at(row, col), h, tolerance(h));
+        EXPECT_NEAR(smoothing.box(ksize).at(row, col), b, tolerance(b));
+      }
+    }
+
+    // bands touching the borders and inside the image only evaluate their own pixels, to the same values
+    for (const cv::Rect& band : {cv::Rect(0, 0, 9, 5), cv::Rect(20, 15, 11, 7), cv::Rect(50, 34, 6, 6)}) {
+      for (CradleFunctions::SmoothedImage* smoothed :
+           {&smoothing.vertical(ksize), &smoothing.horizontal(ksize), &smoothing.box(ksize)}) {
+        smoothed->setBand(band);
+      }
+      for (int row = band.y; row < band.br().y; ++row) {
+        for (int col = band.x; col < band.br().x; ++col) {
+          const float v = vertical.at<float>(row, col);
+          const float h = horizontal.at<float>(row, col);
+          const float b = box.at<float>(row, col);
+          EXPECT_NEAR(smoothing.vertical(ksize).at(row, col), v, tolerance(v));
+          EXPECT_NEAR(smoothing.horizontal(ksize).at(row, col), h, tolerance(h));
+          EXPECT_NEAR(smoothing.box(ksize).at(row, col), b, tolerance(b));
+        }
+      }
+    }
+  }
+
+  // released images are evaluated afresh over the whole image
+  cv::Mat box;
+  cv::filter2D(image, box, CV_32F, cv::Mat(3, 3, CV_32F, cv::Scalar(1.0f / 9)));
+  smoothing.release();
+  EXPECT_NEAR(smoothing.box(3).at(5, 7), box.at<float>(5, 7), 1e-5 * (std::abs(box.at<float>(5, 7)) + 1.0));
+}
+
+TEST(PlatypusBackend, PieceStatisticsMatchSortedMedians) {
+  cv::Mat image = MakeSyntheticTextureImage(48, 48);
+  cv::Mat cradle(image.size(), CV_32F, cv::Scalar(20.0f));
+  cv::Mat mask(image.size(), CV_16U, cv::Scalar(0));
+  mask(cv::Rect(4, 4, 20, 30)).setTo(1);
+  mask(cv::Rect(26, 10, 15, 15)).setTo(2);
+
+  std::vector<CradleFunctions::piece_statistics> stats =
+      CradleFunctions::pieceStatistics(image, cradle, mask, 2);
+  ASSERT_EQ(stats.size(), 3u);
+
+  for (int piece = 0; piece <= 2; ++piece) {
+    std::vector<uchar> values;
+    for (int row = 0; row < image.rows; ++row) {
+      for (int col = 0; col < image.cols; ++col) {
+        if (mask.at<ushort>(row, col) == piece) {
+          int v = image.at<float>(row, col) - cradle.at<float>(row, col);
+          values.push_back(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+      }
+    }
+    std::sort(values.begin(), values.end());
+    ASSERT_EQ(stats[piece].count, static_cast<int>(values.size()));
+    EXPECT_EQ(stats[piece].median, values[values.size() / 2]);
+    EXPECT_EQ(stats[piece].min, values.front());
+    EXPECT_EQ(stats[piece].max, values.back());
+  }
+}
+
+TEST(PlatypusBackend, PieceOutlinesFollowLabelledRegions) {
+  cv::Mat mask(40, 40, CV_16U, cv::Scalar(0));
+  mask(cv::Rect(0, 0, 10, 40)).setTo(1);
+  mask(cv::Rect(20, 5, 8, 8)).setTo(2);
+  mask(cv::Rect(20, 25, 4, 4)).setTo(2);
+  mask(cv::Rect(34, 2, 1, 30)).setTo(2);
+
+  // piece 3, split in two by a row of another piece
+  mask(cv::Rect(30, 34, 10, 6)).setTo(3);
+  mask(cv::Rect(30, 37, 10, 1)).setTo(1);
+
+  // one outline per connected region, top to bottom; the pixel-wide line of piece 2 and the
+  // empty piece 4 get none
+  std::vector<CradleFunctions::piece_outline> outlines = CradleFunctions::pieceOutlines(mask, 4);
+  ASSERT_EQ(outlines.size(), 5u);
+  EXPECT_EQ(outlines[0].piece, 1);
+  EXPECT_EQ(cv::boundingRect(outlines[0].points), cv::Rect(0, 0, 10, 40));
+  EXPECT_EQ(outlines[1].piece, 2);
+  EXPECT_EQ(cv::boundingRect(outlines[1].points), cv::Rect(20, 5, 8, 8));
+  EXPECT_EQ(outlines[2].piece, 2);
+  EXPECT_EQ(cv::boundingRect(outlines[2].points), cv::Rect(20, 25, 4, 4));
+  EXPECT_EQ(outlines[3].piece, 3);
+  EXPECT_EQ(cv::boundingRect(outlines[3].points), cv::Rect(30, 34, 10, 3));
+  EXPECT_EQ(outlines[4].piece, 3);
+  EXPECT_EQ(cv::boundingRect(outlines[4].points), cv::Rect(30, 38, 10, 2));
+}
+
+TEST(PlatypusBackend, PieceLookupMapsSegmentsToCradlePieces) {
+  CradleFunctions::MarkedSegments segments;
+  segments.pieces = 5;
+  segments.pieceIDh = {{1, 3}, {4}};
+  segments.pieceIDv = {{3, 5}};
+
+  CradleFunctions::buildPieceLookup(segments);
+  EXPECT_EQ(segments.piece_h, (std::vector<int>{-1, 0, -1, 0, 1, -1}));
+  EXPECT_EQ(segments.piece_v, (std::vector<int>{-1, -1, -1, 0, -1, 0}));
+}
+
 TEST(PlatypusBackend, RemoveCradleProducesFiniteOutputsAndSegments) {
   cv::Mat image = test_helpers::loadFixtureGrayscaleFloat("cradle.jpg");
   cv::Mat mask = test_helpers::makeEmptyMask(image);
@@ -118,7 +267,7 @@ TEST(PlatypusBackend, TextureRemovalFallsBackWhenLocalClustersAreUnavailable) {
   cv::Mat image = MakeSyntheticTextureImage();
   cv::Mat mask = test_helpers::makeEmptyMask(image);
   cv::Mat out;
-  CradleFunctions::MarkedSegments segments = MakeSegmentLayout(image.size());
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSegmentLayout(image.size());
 
   for (int row = 0; row < image.rows; ++row) {
     segments.piece_mask.at<unsigned short>(row, 4) = 1;
@@ -136,7 +285,7 @@ TEST(PlatypusBackend, TextureRemovalUsesLimitedLocalSamplesWhenClustersAreSparse
   cv::Mat image = MakeSyntheticTextureImage(256, 256);
   cv::Mat mask = test_helpers::makeEmptyMask(image);
   cv::Mat out;
-  CradleFunctions::MarkedSegments segments = MakeSegmentLayout(image.size());
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSegmentLayout(image.size());
 
   for (int row = 48; row <= 66; ++row) {
     segments.piece_mask.at<unsigned short>(row, 48) = 1;
@@ -154,7 +303,7 @@ TEST(PlatypusBackend, TextureRemovalFailsCleanlyWithoutUsableNonCradleSamples) {
   cv::Mat image = MakeSyntheticTextureImage();
   cv::Mat mask = test_helpers::makeEmptyMask(image);
   cv::Mat out;
-  CradleFunctions::MarkedSegments segments = MakeSegmentLayout(image.size());
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSegmentLayout(image.size());
   segments.piece_mask.setTo(cv::Scalar(1));
 
   TextureRemoval::Status status =
@@ -163,3 +312,748 @@ TEST(PlatypusBackend, TextureRemovalFailsCleanlyWithoutUsableNonCradleSamples) {
   EXPECT_EQ(status, TextureRemoval::Status::kInsufficientSamples);
   EXPECT_TRUE(out.empty());
 }
+
+TEST(PlatypusBackend, TextureRemovalCoefficientCacheKeepsResult) {
+  test_helpers::TextureRun run = test_helpers::makeMultiBlockRun();
+  ASSERT_GE(test_helpers::sampledBlockCount(run), 2);
+
+  // no caching and no spill directory: every block is transformed again by every pass
+  TextureRemoval::texture_removal_options options;
+  options.cache_bytes = 0;
+  options.cache_dir.clear();
+  cv::Mat uncached = test_helpers::removeTexture(run, options);
+
+  // nothing resident, everything read back from the spill directory (created by the run)
+  test_helpers::ScratchDirectory spill("platypus-spill");
+  options.cache_dir = spill.path() + "/nested";
+  cv::Mat spilled = test_helpers::removeTexture(run, options);
+
+  // room for a single block: the least recently used ones are spilled as the passes move on
+  options.cache_bytes = size_t(61) * 512 * 512 * sizeof(float);
+  cv::Mat evicted = test_helpers::removeTexture(run, options);
+
+  // default budget, sized to the planned blocks
+  cv::Mat cached = test_helpers::removeTexture(run);
+
+  EXPECT_TRUE(std::filesystem::is_directory(options.cache_dir));
+  EXPECT_TRUE(std::filesystem::is_empty(options.cache_dir));
+  ASSERT_EQ(uncached.size(), run.image.size());
+  EXPECT_EQ(cv::norm(uncached, spilled, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(uncached, evicted, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(uncached, cached, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, DefaultCacheDirectoryIsPerUser) {
+  const std::string dir = TextureRemoval::defaultCacheDirectory();
+  if (!dir.empty()) EXPECT_EQ(std::filesystem::path(dir).filename(), "platypus");
+  EXPECT_EQ(TextureRemoval::texture_removal_options().cache_dir, dir);
+  EXPECT_EQ(TextureRemoval::texture_removal_options().cache_bytes, TextureRemoval::auto_cache_bytes);
+}
+
+TEST(PlatypusBackend, SubbandInterleavingRoundTrips) {
+  int target[61] = {};
+  std::vector<cv::Mat> coeffs(61);
+  cv::RNG rng(7);
+  for (int l = 0; l < 61; ++l) {
+    coeffs[l].create(40, 30, CV_32F);
+    rng.fill(coeffs[l], cv::RNG::UNIFORM, -1.0, 1.0);
+  }
+  for (int l = 0; l < 52; l += 2) {
+    target[l] = 1;  // 26 subbands, as for either orientation
+  }
+
+  cv::Mat features;
+  TextureRemoval::interleaveSubbands(coeffs, target, cv::Size(30, 40), 4, 4, features);
+  ASSERT_EQ(features.rows, 10 * 8);
+  ASSERT_EQ(features.cols, 26);
+  EXPECT_EQ(features.at<float>(2 * 8 + 3, 1), coeffs[2].at<float>(8, 12));
+  EXPECT_EQ(features.at<float>(9 * 8 + 7, 25), coeffs[50].at<float>(36, 28));
+
+  std::vector<cv::Mat> written(61);
+  for (int l = 0; l < 61; ++l) {
+    written[l] = cv::Mat::zeros(40, 30, CV_32F);
+  }
+  cv::Mat dense;
+  TextureRemoval::interleaveSubbands(coeffs, target, cv::Size(30, 40), 1, 1, dense);
+  TextureRemoval::deinterleaveSubbands(dense, target, cv::Size(30, 40), 1, 1, written);
+  for (int l = 0; l < 61; ++l) {
+    EXPECT_EQ(cv::norm(written[l], target[l] ? coeffs[l] : cv::Mat::zeros(40, 30, CV_32F), cv::NORM_INF), 0.0);
+  }
+}
+
+TEST(PlatypusBackend, FoldedModelMatchesPerDrawPosterior) {
+  cv::RNG rng(11);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 120, 26, 1.5);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 200, 26, 1.0);
+
+  TextureRemoval::cradle_model_fitting model = TextureRemoval::gibbsSampling(cradle, noncradle);
+  ASSERT_FALSE(model.W.empty());
+  std::vector<std::vector<float>> folded;
+  TextureRemoval::post_inference(model, cradle, noncradle, folded);
+
+  model.W.release();
+  model.b.release();
+  std::vector<std::vector<float>> per_draw;
+  TextureRemoval::post_inference(model, cradle, noncradle, per_draw);
+
+  ASSERT_EQ(folded.size(), per_draw.size());
+  for (size_t i = 0; i < folded.size(); ++i) {
+    for (size_t j = 0; j < folded[i].size(); ++j) {
+      EXPECT_NEAR(folded[i][j], per_draw[i][j], 1e-3f * (1.0f + std::abs(per_draw[i][j])));
+    }
+  }
+}
+
+TEST(PlatypusBackend, MatrixSeparationMatchesVectorSeparation) {
+  cv::RNG rng(17);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 90, 26, 1.5);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 150, 26, 1.0);
+  TextureRemoval::cradle_model_fitting model = TextureRemoval::gibbsSampling(cradle, noncradle);
+
+  std::vector<float> mean(26), var(26);
+  for (int l = 0; l < 26; ++l) {
+    mean[l] = 0.1f * l;
+    var[l] = l == 3 ? 0.0f : 1.0f + 0.05f * l;
+  }
+  cv::Mat samples(int(cradle.size()), 26, CV_32F);
+  for (int i = 0; i < samples.rows; ++i) {
+    std::copy(cradle[i].begin(), cradle[i].end(), samples.ptr<float>(i));
+  }
+
+  std::vector<std::vector<float>> expected = cradle;
+  TextureRemoval::normalizeSamples(expected, mean, var);
+  TextureRemoval::normalizeSamples(samples, mean, var);
+  std::vector<std::vector<float>> expected_diffs;
+  TextureRemoval::post_inference(model, expected, noncradle, expected_diffs);
+  TextureRemoval::unNormalizeSamples(expected_diffs, mean, var);
+  cv::Mat diffs;
+  TextureRemoval::post_inference(model, samples, diffs);
+  TextureRemoval::unNormalizeSamples(diffs, mean, var);
+
+  ASSERT_EQ(diffs.rows, int(expected_diffs.size()));
+  ASSERT_EQ(diffs.cols, 26);
+  for (int i = 0; i < diffs.rows; ++i) {
+    for (int l = 0; l < 26; ++l) {
+      EXPECT_EQ(samples.at<float>(i, l), expected[i][l]);
+      EXPECT_EQ(diffs.at<float>(i, l), expected_diffs[i][l]);
+    }
+  }
+}
+
+TEST(PlatypusBackend, PerDrawPosteriorMatchesPreviousComputation) {
+  cv::RNG rng(5);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 80, 26, 1.5);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 160, 26, 1.0);
+
+  TextureRemoval::cradle_model_fitting model = TextureRemoval::gibbsSampling(cradle, noncradle);
+  model.W.release();
+  model.b.release();
+
+  std::vector<std::vector<float>> with_noncradle, without_noncradle;
+  TextureRemoval::post_inference(model, cradle, noncradle, with_noncradle);
+  std::vector<std::vector<float>> none;
+  TextureRemoval::post_inference(model, cradle, none, without_noncradle);
+
+  EXPECT_EQ(with_noncradle, without_noncradle);
+
+  // same fit as the per-draw computation before the unused terms were removed
+  std::vector<std::vector<float>> reference = ReferencePerDrawFit(model, cradle);
+  ASSERT_EQ(with_noncradle.size(), reference.size());
+  for (size_t i = 0; i < reference.size(); ++i) {
+    for (size_t j = 0; j < reference[i].size(); ++j) {
+      ASSERT_TRUE(std::isfinite(with_noncradle[i][j]));
+      EXPECT_NEAR(with_noncradle[i][j], reference[i][j], 1e-3f * (1.0f + std::abs(reference[i][j])));
+    }
+  }
+}
+
+TEST(PlatypusBackend, GibbsWorkspaceReuseKeepsDraws) {
+  cv::RNG rng(3);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 60, 26, 1.0);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 90, 26, 1.0);
+  std::vector<std::vector<float>> other_cradle = test_helpers::makeGaussianSamples(rng, 40, 26, 1.0);
+  std::vector<std::vector<float>> other_noncradle = test_helpers::makeGaussianSamples(rng, 70, 26, 1.0);
+
+  // short chains: the burn-in still runs past iteration 20, where k1/k2 start to adapt and buffers resize
+  TextureRemoval::gibbs_settings settings;
+  settings.adaptive = false;
+  settings.max_burn = 30;
+  settings.samples = 5;
+
+  TextureRemoval::gibbs_workspace fresh_ws;
+  TextureRemoval::cradle_model_fitting fresh = TextureRemoval::gibbsSampling(cradle, noncradle, fresh_ws, settings);
+
+  // a workspace that already served a differently sized problem
+  TextureRemoval::gibbs_workspace ws;
+  TextureRemoval::gibbsSampling(other_cradle, other_noncradle, ws, settings);
+  TextureRemoval::cradle_model_fitting reused = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+
+  ASSERT_EQ(fresh.Gamma_v.size(), reused.Gamma_v.size());
+  for (size_t i = 0; i < fresh.Gamma_v.size(); ++i) {
+    EXPECT_EQ(cv::norm(fresh.Gamma_v[i], reused.Gamma_v[i], cv::NORM_INF), 0.0);
+    EXPECT_EQ(cv::norm(fresh.Lambda_v[i], reused.Lambda_v[i], cv::NORM_INF), 0.0);
+  }
+  EXPECT_EQ(cv::norm(fresh.W, reused.W, cv::NORM_INF), 0.0);
+
+  // the sampler before the workspace allocated every buffer per use: whatever the buffers hold when a
+  // run starts, at the right size or not, must never reach the draws
+  for (int size : {0, 7, 26, 90}) {
+    TextureRemoval::gibbs_workspace poisoned;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    for (cv::Mat* m : {&poisoned.cradleMat, &poisoned.noncradleMat, &poisoned.Lmsg, &poisoned.Lmsgt,
+                       &poisoned.Veta1, &poisoned.prod_nc, &poisoned.eta_nctmp, &poisoned.prod_c,
+                       &poisoned.eta_ctmp, &poisoned.gammatrans, &poisoned.lambdatrans, &poisoned.eta2_nc,
+                       &poisoned.eta_nct, &poisoned.alam, &poisoned.Gmsg, &poisoned.Gmsgt, &poisoned.Vxi1,
+                       &poisoned.resid, &poisoned.prod_xi, &poisoned.xi_noise, &poisoned.xi2, &poisoned.xit,
+                       &poisoned.agam}) {
+      *m = cv::Mat(size, size, CV_32F, cv::Scalar(nan));
+    }
+    for (TextureRemoval::gibbs_factor* f : {&poisoned.lam, &poisoned.gam}) {
+      for (cv::Mat* m : {&f->U, &f->diagP, &f->Q, &f->b, &f->z, &f->matlocal}) {
+        *m = cv::Mat(size, size, CV_32F, cv::Scalar(nan));
+      }
+    }
+    for (std::vector<float>* v : {&poisoned.colsum, &poisoned.lind, &poisoned.xisum}) v->assign(size, nan);
+
+    TextureRemoval::cradle_model_fitting stale = TextureRemoval::gibbsSampling(cradle, noncradle, poisoned, settings);
+    ASSERT_EQ(fresh.Gamma_v.size(), stale.Gamma_v.size());
+    for (size_t i = 0; i < fresh.Gamma_v.size(); ++i) {
+      EXPECT_EQ(cv::norm(fresh.Gamma_v[i], stale.Gamma_v[i], cv::NORM_INF), 0.0) << "size " << size;
+      EXPECT_EQ(cv::norm(fresh.Lambda_v[i], stale.Lambda_v[i], cv::NORM_INF), 0.0) << "size " << size;
+    }
+  }
+}
+
+TEST(PlatypusBackend, SpdSolvesMatchExplicitInverse) {
+  cv::RNG rng(5);
+  cv::Mat F(8, 6, CV_32F);
+  rng.fill(F, cv::RNG::NORMAL, 0, 1);
+  cv::Mat A = F.t() * F + cv::Mat::eye(6, 6, CV_32F);
+  cv::Mat B(10, 6, CV_32F), Z(10, 6, CV_32F);
+  rng.fill(B, cv::RNG::NORMAL, 0, 1);
+  rng.fill(Z, cv::RNG::NORMAL, 0, 1);
+
+  cv::Mat U, Ainv, Uinv;
+  TextureRemoval::Cholesky(A, U);
+  cv::invert(A, Ainv);
+  cv::invert(U, Uinv);
+
+  cv::Mat X;
+  TextureRemoval::spdSolveRows(U, B, X);
+  EXPECT_LT(cv::norm(X, B * Ainv, cv::NORM_INF), 1e-4);
+
+  TextureRemoval::spdSampleRows(U, B, Z, X);
+  EXPECT_LT(cv::norm(X, B * Ainv + Z * Uinv.t(), cv::NORM_INF), 1e-4);
+
+  cv::Mat C = B.t();
+  TextureRemoval::spdSolve(U, C, X);
+  EXPECT_LT(cv::norm(X, Ainv * C, cv::NORM_INF), 1e-4);
+}
+
+TEST(PlatypusBackend, GibbsBurnInStopsWithinConfiguredBounds) {
+  cv::RNG rng(7);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 60, 26, 1.0);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 90, 26, 1.0);
+
+  TextureRemoval::gibbs_workspace ws;
+  TextureRemoval::gibbs_settings settings;
+  settings.min_burn = 40;
+  settings.max_burn = 120;
+  settings.samples = 20;
+  settings.window = 20;
+
+  settings.adaptive = false;
+  TextureRemoval::cradle_model_fitting fixed = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+  EXPECT_EQ(fixed.burn_in, 120);
+  EXPECT_EQ(fixed.iterations, 140);
+  EXPECT_EQ(fixed.Gamma_v.size(), 20u);
+
+  settings.adaptive = true;
+  TextureRemoval::cradle_model_fitting adaptive = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+  EXPECT_GE(adaptive.burn_in, 40);
+  EXPECT_LE(adaptive.burn_in, 120);
+  EXPECT_EQ(adaptive.iterations, adaptive.burn_in + 20);
+  ASSERT_EQ(adaptive.Lambda_v.size(), 20u);
+  if (adaptive.burn_in < 120) EXPECT_LT(adaptive.rhat, settings.rhat);
+  for (const cv::Mat& lambda : adaptive.Lambda_v) EXPECT_TRUE(cv::checkRange(lambda));
+}
+
+TEST(PlatypusBackend, GibbsBurnInEndsEarlyOnWellMixingChain) {
+  // white noise on both sides: the factor model has nothing to find and the chain settles within a few
+  // dozen iterations, while k1/k2 keep adapting throughout the burn-in
+  cv::RNG rng(13);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 80, 26, 1.0);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 120, 26, 1.0);
+
+  TextureRemoval::gibbs_workspace ws;
+  TextureRemoval::gibbs_settings settings;
+  settings.min_burn = 50;
+  settings.max_burn = 1000;
+  settings.samples = 10;
+  settings.window = 50;
+  settings.rhat = 1.1f;
+
+  TextureRemoval::cradle_model_fitting model = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+  EXPECT_GE(model.burn_in, settings.min_burn);
+  EXPECT_LT(model.burn_in, settings.max_burn);
+  EXPECT_LT(model.rhat, settings.rhat);
+  EXPECT_EQ(model.iterations, model.burn_in + settings.samples);
+}
+
+TEST(PlatypusBackend, GibbsKeepsLatentDrawsOnlyOnRequest) {
+  cv::RNG rng(11);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 50, 26, 1.0);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 80, 26, 1.0);
+
+  TextureRemoval::gibbs_workspace ws;
+  TextureRemoval::gibbs_settings settings;
+  settings.adaptive = false;
+  settings.max_burn = 30;
+  settings.samples = 10;
+
+  TextureRemoval::cradle_model_fitting lean = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+  EXPECT_TRUE(lean.xi_v.empty());
+  EXPECT_TRUE(lean.etac_v.empty());
+  EXPECT_TRUE(lean.etanc_v.empty());
+  EXPECT_EQ(lean.Lambda_v.size(), 10u);
+
+  settings.keep_latent = true;
+  TextureRemoval::cradle_model_fitting full = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+  ASSERT_EQ(full.xi_v.size(), 10u);
+  EXPECT_EQ(full.etac_v[0].rows, 50);
+  EXPECT_EQ(full.etanc_v[0].rows, 80);
+  EXPECT_EQ(cv::norm(lean.W, full.W, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, ModelFilesRoundTripAndSeedChains) {
+  cv::RNG rng(13);
+  std::vector<std::vector<float>> cradle = test_helpers::makeGaussianSamples(rng, 50, 26, 1.0);
+  std::vector<std::vector<float>> noncradle = test_helpers::makeGaussianSamples(rng, 80, 26, 1.0);
+
+  TextureRemoval::gibbs_workspace ws;
+  TextureRemoval::gibbs_settings settings;
+  settings.max_burn = 60;
+  settings.samples = 10;
+  TextureRemoval::cradle_model_fitting model = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+
+  std::string path = test_helpers::temporaryPath("platypus-model", ".bin");
+  ASSERT_TRUE(TextureRemoval::saveModel(model, path));
+  TextureRemoval::cradle_model_fitting loaded;
+  ASSERT_TRUE(TextureRemoval::loadModel(path, loaded));
+  std::filesystem::remove(path);
+
+  EXPECT_EQ(loaded.burn_in, model.burn_in);
+  EXPECT_EQ(loaded.iterations, model.iterations);
+  EXPECT_EQ(loaded.rho_v, model.rho_v);
+  ASSERT_EQ(loaded.Lambda_v.size(), model.Lambda_v.size());
+  for (size_t i = 0; i < model.Lambda_v.size(); ++i) {
+    EXPECT_EQ(cv::norm(loaded.Lambda_v[i], model.Lambda_v[i], cv::NORM_INF), 0.0);
+    EXPECT_EQ(cv::norm(loaded.Gamma_v[i], model.Gamma_v[i], cv::NORM_INF), 0.0);
+    EXPECT_EQ(cv::norm(loaded.kappa_v[i], model.kappa_v[i], cv::NORM_INF), 0.0);
+    EXPECT_EQ(cv::norm(loaded.ps_v[i], model.ps_v[i], cv::NORM_INF), 0.0);
+  }
+  EXPECT_EQ(cv::norm(loaded.W, model.W, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(loaded.b, model.b, cv::NORM_INF), 0.0);
+  EXPECT_FALSE(TextureRemoval::loadModel(path, loaded));
+
+  // a chain started from a trained model keeps its factor counts
+  settings.seed = &model;
+  TextureRemoval::cradle_model_fitting seeded = TextureRemoval::gibbsSampling(cradle, noncradle, ws, settings);
+  ASSERT_EQ(seeded.Lambda_v.size(), 10u);
+  EXPECT_EQ(seeded.Lambda_v[0].cols, model.Lambda_v.back().cols);
+  EXPECT_EQ(seeded.Gamma_v[0].cols, model.Gamma_v.back().cols);
+  EXPECT_TRUE(cv::checkRange(seeded.W));
+}
+
+TEST(PlatypusBackend, TextureRemovalModelCacheKeepsResult) {
+  // two pieces over several blocks each: one model per piece
+  test_helpers::TextureRun run = test_helpers::makeMultiBlockRun(2);
+  cv::Mat trained = test_helpers::removeTexture(run);
+
+  test_helpers::ScratchDirectory models("platypus-models");
+  TextureRemoval::texture_removal_options options;
+  options.model_dir = models.path();
+  cv::Mat stored = test_helpers::removeTexture(run, options);
+  std::vector<std::filesystem::path> files;
+  for (const auto& entry : std::filesystem::directory_iterator(models.path())) files.push_back(entry.path());
+  ASSERT_EQ(files.size(), 2u);
+
+  // every model found
+  cv::Mat reused = test_helpers::removeTexture(run, options);
+
+  // one model evicted: its piece is trained again and stored back, the other one is reused
+  std::filesystem::remove(files[0]);
+  cv::Mat retrained = test_helpers::removeTexture(run, options);
+  EXPECT_TRUE(std::filesystem::exists(files[0]));
+  EXPECT_TRUE(std::filesystem::exists(files[1]));
+
+  ASSERT_EQ(trained.size(), run.image.size());
+  EXPECT_EQ(cv::norm(trained, stored, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(trained, reused, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(trained, retrained, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, KnnInterpolationMatchesExhaustiveSearch) {
+  cv::RNG rng(17);
+  cv::Mat points(300, 26, CV_32F), values(300, 26, CV_32F), queries(200, 26, CV_32F);
+  rng.fill(points, cv::RNG::NORMAL, 0, 1);
+  rng.fill(values, cv::RNG::NORMAL, 0, 1);
+  rng.fill(queries, cv::RNG::NORMAL, 0, 1);
+  const int k = 5;
+
+  cv::Mat out;
+  TextureRemoval::knnInterpolate(queries, points, values, k, out);
+  ASSERT_EQ(out.rows, queries.rows);
+  ASSERT_EQ(out.cols, values.cols);
+
+  for (int i = 0; i < queries.rows; ++i) {
+    std::vector<std::pair<double, int>> dist(points.rows);
+    for (int j = 0; j < points.rows; ++j) {
+      dist[j] = {cv::norm(queries.row(i), points.row(j), cv::NORM_L2SQR), j};
+    }
+    std::partial_sort(dist.begin(), dist.begin() + k, dist.end());
+    cv::Mat expected(1, values.cols, CV_64F, cv::Scalar(0));
+    double sumweight = 0;
+    for (int m = 0; m < k; ++m) {
+      double w = 1.0 / (1 + dist[m].first);
+      cv::Mat row;
+      values.row(dist[m].second).convertTo(row, CV_64F);
+      expected += w * row;
+      sumweight += w;
+    }
+    expected /= sumweight;
+    cv::Mat got;
+    out.row(i).convertTo(got, CV_64F);
+    EXPECT_LT(cv::norm(got, expected, cv::NORM_INF), 1e-4);
+  }
+}
+
+TEST(PlatypusBackend, DeferredBlockReconstructionMatchesDirectWrite) {
+  cv::Mat block = MakeSyntheticTextureImage(512, 512);
+  std::vector<cv::Mat> coeffs = FFST::shearletTransformSpect(block);
+
+  // a block at offset (100, 200) whose centre drops 24 pixels on every side
+  cv::Mat direct(800, 900, CV_32F, cv::Scalar(0));
+  TextureRemoval::reconstructBlock(direct, coeffs, 100, 200, 124, 224, 588, 688);
+
+  cv::Mat split(800, 900, CV_32F, cv::Scalar(0));
+  std::pair<cv::Rect, cv::Mat> part;
+  std::vector<std::pair<cv::Rect, cv::Mat>> deferred;
+  cv::Rect inner(cv::Point(248, 148), cv::Point(664, 564));
+  TextureRemoval::reconstructBlock(coeffs, 100, 200, 124, 224, 588, 688, inner, part, deferred);
+  EXPECT_EQ(part.first, inner);
+  part.second.copyTo(split(part.first));
+  for (const auto& strip : deferred) strip.second.copyTo(split(strip.first));
+
+  EXPECT_EQ(deferred.size(), 4u);
+  EXPECT_EQ(cv::norm(direct, split, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, SelectiveShearletTransformMatchesFFST) {
+  cv::Mat block = MakeSyntheticTextureImage(512, 512);
+  std::vector<cv::Mat> expected = FFST::shearletTransformSpect(block);
+
+  std::vector<bool> subbands(expected.size());
+  for (size_t l = 0; l < subbands.size(); l += 3) subbands[l] = true;
+  std::vector<cv::Mat> selected = TextureRemoval::shearletTransform(block, subbands);
+  std::vector<cv::Mat> all = TextureRemoval::shearletTransform(block);
+
+  ASSERT_EQ(selected.size(), expected.size());
+  ASSERT_EQ(all.size(), expected.size());
+  for (size_t l = 0; l < expected.size(); ++l) {
+    const double tolerance = 1e-4 * (cv::norm(expected[l], cv::NORM_INF) + 1.0);
+    ASSERT_EQ(all[l].size(), expected[l].size());
+    EXPECT_LT(cv::norm(all[l], expected[l], cv::NORM_INF), tolerance) << "subband " << l;
+    if (subbands[l]) {
+      EXPECT_EQ(cv::norm(selected[l], all[l], cv::NORM_INF), 0.0) << "subband " << l;
+    } else {
+      EXPECT_TRUE(selected[l].empty()) << "subband " << l;
+    }
+  }
+}
+
+TEST(PlatypusBackend, TextureRemovalSpilledTextureKeepsResult) {
+  // eight 256 pixel tiles, each block reading and writing several of them
+  test_helpers::TextureRun run = test_helpers::makeMultiBlockRun();
+  cv::Mat resident = test_helpers::removeTexture(run);
+
+  // a budget of a single tile: every other tile lives in the spill file
+  test_helpers::ScratchDirectory spill("platypus-texture");
+  TextureRemoval::texture_removal_options options;
+  options.texture_bytes = 1;
+  options.texture_dir = spill.path();
+  cv::Mat spilled = test_helpers::removeTexture(run, options);
+
+  // room for half the tiles
+  options.texture_bytes = size_t(4) * 256 * 256 * sizeof(float);
+  cv::Mat partial = test_helpers::removeTexture(run, options);
+
+  EXPECT_TRUE(std::filesystem::is_empty(spill.path()));
+  ASSERT_EQ(resident.size(), run.image.size());
+  EXPECT_EQ(cv::norm(resident, spilled, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(resident, partial, cv::NORM_INF), 0.0);
+
+  // the separation changed the input
+  EXPECT_GT(cv::norm(resident, run.image, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, CounterBasedNoiseIsAddressedByElement) {
+  cv::Mat large(37, 10, CV_32F), small(5, 7, CV_32F);
+  TextureRemoval::fillNormal(large, 42, 3, 2);
+  TextureRemoval::fillNormal(small, 42, 3, 2);
+  EXPECT_EQ(cv::norm(large(cv::Rect(0, 0, 7, 5)), small, cv::NORM_INF), 0.0);
+
+  cv::Mat other(37, 10, CV_32F);
+  TextureRemoval::fillNormal(other, 42, 4, 2);
+  EXPECT_GT(cv::norm(large, other, cv::NORM_INF), 0.0);
+
+  cv::Scalar mean, stddev;
+  cv::Mat many(200, 200, CV_32F);
+  TextureRemoval::fillNormal(many, 7, 0, 0);
+  cv::meanStdDev(many, mean, stddev);
+  EXPECT_NEAR(mean[0], 0.0, 0.02);
+  EXPECT_NEAR(stddev[0], 1.0, 0.02);
+
+  TextureRemoval::PhiloxEngine first(5), second(5);
+  first.seek(9, 1);
+  for (int i = 0; i < 6; i++) first();
+  second.seek(9, 1);
+  for (int i = 0; i < 6; i++) second();
+  EXPECT_EQ(first(), second());
+  first.seek(9, 1);
+  const uint32_t restarted = first();
+  second.seek(9, 1);
+  EXPECT_EQ(restarted, second());
+}
+
+namespace {
+
+struct RegionRecorder : CradleFunctions::Callbacks {
+  explicit RegionRecorder(const cv::Mat& image) : canvas(image.clone()) {}
+
+  bool progress(int, int) const override { return true; }
+
+  bool region(const cv::Rect& rect, const cv::Mat& pixels) const override {
+    pixels.copyTo(canvas(rect));
+    ++published;
+    return true;
+  }
+
+  mutable cv::Mat canvas;
+  mutable int published = 0;
+};
+
+}  // namespace
+
+TEST(PlatypusBackend, TextureRemovalPublishesFinishedRegions) {
+  cv::Mat image = MakeSyntheticTextureImage(256, 256);
+  cv::Mat mask = test_helpers::makeEmptyMask(image);
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSingleStripSegments(image.size());
+
+  RegionRecorder recorder(image);
+  CradleFunctions::setCallbacks(&recorder);
+  cv::Mat out;
+  TextureRemoval::textureRemove(image, mask, out, segments);
+  CradleFunctions::setCallbacks(nullptr);
+
+  // replaying the published regions in order rebuilds the final output
+  EXPECT_GT(recorder.published, 0);
+  ASSERT_EQ(out.size(), image.size());
+  EXPECT_EQ(cv::norm(recorder.canvas, out, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, BlockLayoutRejectsUnsupportedSettings) {
+  EXPECT_TRUE(TextureRemoval::supportedBlockSize(256));
+  EXPECT_TRUE(TextureRemoval::supportedBlockSize(512));
+  EXPECT_TRUE(TextureRemoval::supportedBlockSize(1024));
+  EXPECT_FALSE(TextureRemoval::supportedBlockSize(300));
+  EXPECT_FALSE(TextureRemoval::supportedBlockSize(2048));
+
+  TextureRemoval::block_layout layout;
+  EXPECT_TRUE(TextureRemoval::validBlockLayout(layout));
+  layout.size = 1024;
+  EXPECT_TRUE(TextureRemoval::validBlockLayout(layout));
+  layout.size = 300;
+  EXPECT_FALSE(TextureRemoval::validBlockLayout(layout));
+  layout.size = 512;
+  layout.overlap = 31;
+  EXPECT_FALSE(TextureRemoval::validBlockLayout(layout));
+  layout.overlap = 256;
+  EXPECT_FALSE(TextureRemoval::validBlockLayout(layout));
+
+  cv::Mat image = MakeSyntheticTextureImage(600, 300);
+  cv::Mat mask = test_helpers::makeEmptyMask(image);
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSingleStripSegments(image.size());
+
+  TextureRemoval::texture_removal_options options;
+  options.layout.overlap = 31;
+  cv::Mat out;
+  EXPECT_THROW(TextureRemoval::textureRemove(image, mask, out, segments, options), cv::Exception);
+
+  options.layout.overlap = 16;
+  TextureRemoval::textureRemove(image, mask, out, segments, options);
+
+  ASSERT_EQ(out.size(), image.size());
+  ExpectFiniteMat(out);
+  EXPECT_GT(cv::norm(out, image, cv::NORM_INF), 0.0);
+
+  // smaller blocks: the 600x300 image spans several of them in both directions
+  options.layout.size = 256;
+  cv::Mat small;
+  TextureRemoval::textureRemove(image, mask, small, segments, options);
+
+  ASSERT_EQ(small.size(), image.size());
+  ExpectFiniteMat(small);
+  EXPECT_GT(cv::norm(small, image, cv::NORM_INF), 0.0);
+}
+
+TEST(PlatypusBackend, ShearletTransformInvertsAtEverySupportedSize) {
+  for (int size : {256, 512, 1024}) {
+    cv::Mat block = MakeSyntheticTextureImage(size, size);
+    std::vector<cv::Mat> coeffs = TextureRemoval::shearletTransform(block);
+    ASSERT_FALSE(coeffs.empty()) << "size " << size;
+    for (const cv::Mat& c : coeffs) ASSERT_EQ(c.size(), block.size()) << "size " << size;
+
+    cv::Mat restored = TextureRemoval::inverseShearletTransform(coeffs);
+    ASSERT_EQ(restored.size(), block.size()) << "size " << size;
+    EXPECT_LT(cv::norm(restored, block, cv::NORM_INF), 1e-3 * (cv::norm(block, cv::NORM_INF) + 1.0))
+        << "size " << size;
+  }
+}
+
+TEST(PlatypusBackend, SampleReservoirKeepsLowestPrioritiesInAnyOrder) {
+  std::vector<float> values(40);
+  std::vector<uint64_t> priorities(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = static_cast<float>(i);
+    priorities[i] = (i * 7919u) % 101u;
+  }
+
+  // small classes keep every sample
+  TextureRemoval::SampleReservoir small(50, 1);
+  for (size_t i = 0; i < values.size(); ++i) small.add(&values[i], priorities[i]);
+  EXPECT_EQ(small.samples().size(), values.size());
+
+  // the cap keeps the samples of lowest priority, whatever the order they arrive in
+  std::vector<size_t> order(values.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::vector<size_t> expected = order;
+  std::sort(expected.begin(), expected.end(),
+            [&](size_t a, size_t b) { return priorities[a] < priorities[b]; });
+
+  for (int pass = 0; pass < 2; ++pass) {
+    TextureRemoval::SampleReservoir capped(10, 1);
+    for (size_t i : order) capped.add(&values[i], priorities[i]);
+    std::vector<std::vector<float>> kept = capped.samples();
+    ASSERT_EQ(kept.size(), 10u);
+    for (size_t i = 0; i < kept.size(); ++i) EXPECT_EQ(kept[i][0], values[expected[i]]);
+    std::reverse(order.begin(), order.end());
+  }
+}
+
+namespace {
+
+// Part of block z of 'plan' that the block writes back, in padded image coordinates
+cv::Rect BlockCentre(const TextureRemoval::block_plan& plan, int z, const cv::Size& image) {
+  const std::vector<int>& c = plan.coords[z];
+  const int rows = image.height + 2 * plan.pad, cols = image.width + 2 * plan.pad;
+  return cv::Rect(cv::Point(c[1] != 0 ? c[1] + plan.pad : c[1], c[0] != 0 ? c[0] + plan.pad : c[0]),
+                  cv::Point(c[3] != cols ? c[3] - plan.pad : c[3], c[2] != rows ? c[2] - plan.pad : c[2]));
+}
+
+cv::Rect BlockExtent(const TextureRemoval::block_plan& plan, int z) {
+  const std::vector<int>& c = plan.coords[z];
+  return cv::Rect(cv::Point(c[1], c[0]), cv::Point(c[3], c[2]));
+}
+
+}  // namespace
+
+TEST(PlatypusBackend, BlockPlanDecomposesOnlyAroundSampledBlocks) {
+  // a long panel with cradle in its first rows only: far more blocks than non-cradle picks
+  cv::Size size(300, 20000);
+  cv::Mat mask(size, CV_8U, cv::Scalar(0));
+  cv::Mat piece_mask(size, CV_16U, cv::Scalar(0));
+  piece_mask(cv::Rect(100, 0, 40, 200)).setTo(1);
+
+  TextureRemoval::block_plan plan = TextureRemoval::planBlocks(mask, piece_mask, TextureRemoval::block_layout());
+  const int blocks = static_cast<int>(plan.coords.size());
+  ASSERT_GT(blocks, 30);
+
+  EXPECT_TRUE(plan.reconstructed[0]);
+  EXPECT_EQ(std::count(plan.reconstructed.begin(), plan.reconstructed.end(), true), 1);
+  for (int z = 0; z < blocks; ++z) {
+    if (plan.reconstructed[z]) EXPECT_TRUE(plan.sampled[z]);
+  }
+  EXPECT_EQ(std::count(plan.sampled.begin(), plan.sampled.end(), true), 9);  // 1 with cradle + 8 picks
+
+  std::vector<bool> decomposed(blocks);
+  for (int z : plan.decomposed) decomposed[z] = true;
+  for (int y = 0; y < blocks; ++y) {
+    bool near_sampled = false;
+    for (int z = 0; z < blocks; ++z) {
+      near_sampled |= plan.sampled[z] && (BlockExtent(plan, z) & BlockCentre(plan, y, size)).area() > 0;
+    }
+    EXPECT_EQ(decomposed[y], near_sampled) << "block " << y;
+  }
+  EXPECT_LT(static_cast<int>(plan.decomposed.size()), blocks);
+}
+
+TEST(PlatypusBackend, TextureRemovalFollowsBlockPlan) {
+  cv::Mat image = MakeSyntheticTextureImage(1200, 300);
+  cv::Mat mask = test_helpers::makeEmptyMask(image);
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSegmentLayout(image.size());
+  segments.piece_mask(cv::Rect(100, 0, 40, 200)).setTo(1);
+
+  TextureRemoval::block_plan plan =
+      TextureRemoval::planBlocks(mask, segments.piece_mask, TextureRemoval::block_layout());
+  ASSERT_GT(plan.coords.size(), 1u);
+
+  TextureRemoval::texture_removal_report report;
+  cv::Mat out;
+  TextureRemoval::textureRemove(image, mask, out, segments, TextureRemoval::texture_removal_options(), &report);
+  ASSERT_EQ(out.size(), image.size());
+  EXPECT_EQ(report.blocks, static_cast<int>(plan.coords.size()));
+  EXPECT_EQ(report.decomposed, static_cast<int>(plan.decomposed.size()));
+  EXPECT_EQ(report.sampled, static_cast<int>(std::count(plan.sampled.begin(), plan.sampled.end(), true)));
+
+  // only the centres of blocks with cradle are written back; every other pixel keeps its input
+  cv::Mat written(image.size(), CV_8U, cv::Scalar(0));
+  for (size_t z = 0; z < plan.coords.size(); ++z) {
+    if (!plan.reconstructed[z]) continue;
+    cv::Rect centre = (BlockCentre(plan, static_cast<int>(z), image.size()) - cv::Point(plan.pad, plan.pad)) &
+                      cv::Rect(0, 0, image.cols, image.rows);
+    written(centre).setTo(1);
+  }
+  cv::Mat kept;
+  cv::compare(out, image, kept, cv::CMP_EQ);
+  kept.setTo(255, written);
+  EXPECT_EQ(cv::countNonZero(kept), static_cast<int>(image.total()));
+  EXPECT_GT(cv::norm(out, image, cv::NORM_INF, written), 0.0);
+}
+
+TEST(PlatypusBackend, TextureRemovalOverlappingBlocksReadPrePieceTexture) {
+  // a strip over the full height of three overlapping blocks, all separated for the same piece
+  cv::Mat image = MakeSyntheticTextureImage(1000, 300);
+  cv::Mat mask = test_helpers::makeEmptyMask(image);
+  CradleFunctions::MarkedSegments segments = test_helpers::makeSingleStripSegments(image.size());
+
+  TextureRemoval::block_plan plan =
+      TextureRemoval::planBlocks(mask, segments.piece_mask, TextureRemoval::block_layout());
+  ASSERT_GE(std::count(plan.reconstructed.begin(), plan.reconstructed.end(), true), 2);
+  ASSERT_GT((BlockExtent(plan, 0) & BlockCentre(plan, 1, image.size())).area(), 0);
+
+  // reference: every block is resident before the piece, so all of them are rebuilt from the pre-piece texture
+  cv::Mat reference;
+  TextureRemoval::textureRemove(image, mask, reference, segments);
+
+  // no caching: every block is transformed again from the texture while its neighbours are being written
+  TextureRemoval::texture_removal_options options;
+  options.cache_bytes = 0;
+  options.cache_dir.clear();
+  cv::Mat uncached;
+  TextureRemoval::textureRemove(image, mask, uncached, segments, options);
+
+  ASSERT_EQ(reference.size(), image.size());
+  EXPECT_GT(cv::norm(reference, image, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(uncached, reference, cv::NORM_INF), 0.0);
+}
@@ -5,6 +5,8 @@
 #include <dicomLoader.h>
 #include <imageManager.h>
 #include <mainWindow.h>
+#include <mask.h>
+#include <platypus/CradleFunctions.h>
 #include <polygonCommands.h>
 #include <project.h>
 #include <textureRemovalStatus.h>
@@ -17,9 +19,17 @@
 #include <QtCore/QFile>
 #include <QtCore/QMetaObject>
 #include <QtCore/QTemporaryDir>
+#include <QtGui/QPainter>
+#include <QtGui/QPainterPath>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace {
 
@@ -81,6 +91,22 @@ class FakeImageSource : public ImageSource {
   QImage image_;
 };
 
+// Distance from p to the closest edge of the closed polygons
+double DistanceToOutline(const QList<QPolygonF>& outline, const QPointF& p) {
+  double best = std::numeric_limits<double>::max();
+  for (const QPolygonF& poly : outline) {
+    for (int i = 0; i < poly.size(); ++i) {
+      const QPointF a = poly[i];
+      const QPointF d = poly[(i + 1) % poly.size()] - a;
+      const double len2 = QPointF::dotProduct(d, d);
+      const double t = len2 > 0 ? std::clamp(QPointF::dotProduct(p - a, d) / len2, 0.0, 1.0) : 0.0;
+      const QPointF q = a + t * d - p;
+      best = std::min(best, std::hypot(q.x(), q.y()));
+    }
+  }
+  return best;
+}
+
 }  // namespace
 
 TEST(PlatypusQt, TextureRemovalMessagesMatchStatus) {
@@ -155,6 +181,133 @@ TEST(PlatypusQt, ImageManagerLoadsAndClearsFixture) {
   EXPECT_EQ(manager.source(), nullptr);
 }
 
+TEST(PlatypusQt, ScanlineMaskMatchesQPainterFill) {
+  const QSize size(96, 80);
+  std::vector<std::pair<const char*, QPainterPath>> paths;
+
+  QPainterPath concave;
+  concave.addPolygon(QPolygonF({QPointF(5.3, 4.7), QPointF(70.2, 8.1), QPointF(30.6, 24.4),
+                                QPointF(68.9, 70.3), QPointF(6.1, 60.8)}));
+  concave.closeSubpath();
+  paths.emplace_back("concave", concave);
+
+  // pentagram: the odd-even rule leaves the inner pentagon empty
+  QPolygonF star;
+  for (int k = 0; k < 5; ++k) {
+    const double angle = -CV_PI / 2 + k * 4 * CV_PI / 5;
+    star << QPointF(48.3 + 35.2 * std::cos(angle), 40.6 + 35.2 * std::sin(angle));
+  }
+  QPainterPath self_intersecting;
+  self_intersecting.addPolygon(star);
+  self_intersecting.closeSubpath();
+  paths.emplace_back("self-intersecting", self_intersecting);
+
+  // slivers thinner than a pixel and edges between pixel centres
+  QPainterPath sub_pixel;
+  sub_pixel.addRect(QRectF(10.3, 12.2, 60.4, 0.7));
+  sub_pixel.addRect(QRectF(20.8, 30.1, 0.4, 25.3));
+  sub_pixel.addPolygon(QPolygonF({QPointF(40.2, 40.3), QPointF(90.7, 43.6), QPointF(41.9, 44.2)}));
+  sub_pixel.closeSubpath();
+  paths.emplace_back("sub-pixel", sub_pixel);
+
+  QPainterPath curved;
+  curved.addEllipse(QRectF(8.4, 9.6, 45.3, 31.7));
+  curved.moveTo(50.5, 70.2);
+  curved.cubicTo(QPointF(95.1, 75.3), QPointF(60.7, 10.4), QPointF(88.2, 45.9));
+  curved.quadTo(QPointF(70.3, 60.6), QPointF(50.5, 70.2));
+  paths.emplace_back("curved", curved);
+
+  for (const auto& [name, path] : paths) {
+    IplImage* scanline = cvCreateImage(cvSize(size.width(), size.height()), IPL_DEPTH_8U, 1);
+    cvZero(scanline);
+    rasterizeMask(scanline, path, 0x04);
+
+    QImage painted(size, QImage::Format_Grayscale8);
+    painted.fill(0);
+    QPainter painter(&painted);
+    painter.setRenderHint(QPainter::Antialiasing, false);
+    painter.fillPath(path, QColor(255, 255, 255));
+    painter.end();
+
+    // only the rounding of the pixel centres next to the outline (and of the curve flattening) may differ
+    const QList<QPolygonF> outline = path.toSubpathPolygons();
+    double perimeter = 0;
+    for (const QPolygonF& poly : outline) {
+      for (int i = 0; i < poly.size(); ++i) {
+        const QPointF d = poly[(i + 1) % poly.size()] - poly[i];
+        perimeter += std::hypot(d.x(), d.y());
+      }
+    }
+    int filled = 0, differing = 0;
+    for (int y = 0; y < size.height(); ++y) {
+      const uchar* mask_row = iplImageRow<uchar>(scanline, y);
+      const uchar* paint_row = painted.constScanLine(y);
+      for (int x = 0; x < size.width(); ++x) {
+        EXPECT_TRUE(mask_row[x] == 0 || mask_row[x] == 0x04) << name;
+        const bool in_mask = mask_row[x] != 0;
+        filled += in_mask;
+        if (in_mask != (paint_row[x] != 0)) {
+          ++differing;
+          EXPECT_LT(DistanceToOutline(outline, QPointF(x + 0.5, y + 0.5)), 1.0) << name << " at " << x << "," << y;
+        }
+      }
+    }
+    EXPECT_GT(filled, 0) << name;
+    EXPECT_LE(differing, perimeter / 8 + 2) << name;
+    cvReleaseImage(&scanline);
+  }
+}
+
+TEST(PlatypusQt, MappedImagesRemoveCradleLikeHeapImages) {
+  const cv::Mat image = test_helpers::loadFixtureGrayscaleFloat("cradle.jpg");
+  const CvSize size = cvSize(image.cols, image.rows);
+
+  // buffers as the GUI hands them to removeCradle(), with the input and mask as their working copies
+  struct Buffers {
+    cvImageRef input, output, mask;
+    cv::Mat out, cradle;
+    CradleFunctions::MarkedSegments segments;
+  };
+  auto run = [&](Buffers& buffers) {
+    ImageManager::createImage(buffers.input, size, IPL_DEPTH_32F);
+    ImageManager::createImage(buffers.output, size, IPL_DEPTH_32F);
+    ImageManager::createImage(buffers.mask, size, IPL_DEPTH_8U);
+    cv::Mat in = cv::cvarrToMat(buffers.input.get());
+    cv::Mat mask = cv::cvarrToMat(buffers.mask.get());
+    image.copyTo(in);
+    mask.setTo(0);
+    buffers.out = cv::cvarrToMat(buffers.output.get());
+    CradleFunctions::removeCradle(in, buffers.out, buffers.cradle, mask, buffers.segments);
+  };
+
+  Buffers heap;
+  run(heap);
+
+  QTemporaryDir spill;
+  ASSERT_TRUE(spill.isValid());
+  const qint64 mapped_bytes = ImageManager::mappedImageBytes();
+  ImageManager::setSpillDirectory(spill.path());
+  ImageManager::setMappedImageBytes(0);
+  auto mapped = std::make_unique<Buffers>();
+  run(*mapped);
+  ImageManager::setMappedImageBytes(mapped_bytes);
+  ImageManager::setSpillDirectory(QString());
+
+  // every buffer is file backed, and removeCradle() wrote its result in place
+  EXPECT_EQ(QDir(spill.path()).entryList(QDir::Files).size(), 3);
+  EXPECT_EQ(mapped->out.data, reinterpret_cast<uchar*>(mapped->output->imageData));
+
+  ASSERT_EQ(mapped->out.size(), heap.out.size());
+  EXPECT_EQ(cv::norm(mapped->out, heap.out, cv::NORM_INF), 0.0);
+  EXPECT_EQ(cv::norm(mapped->cradle, heap.cradle, cv::NORM_INF), 0.0);
+  EXPECT_EQ(mapped->segments.pieces, heap.segments.pieces);
+  EXPECT_EQ(cv::norm(mapped->segments.piece_mask, heap.segments.piece_mask, cv::NORM_INF), 0.0);
+
+  // the files go with the last reference to their image
+  mapped.reset();
+  EXPECT_TRUE(QDir(spill.path()).entryList(QDir::Files).isEmpty());
+}
+
 TEST(PlatypusQt, ImageManagerLoadsExistingTiffFixture) {
   ImageManager manager;
 
@@ -2,6 +2,7 @@
 
 #include <opencv2/imgcodecs.hpp>
 
+#include <algorithm>
 #include <filesystem>
 #include <limits>
 #include <random>
@@ -42,4 +43,66 @@ std::string temporaryPath(const std::string& stem, const std::string& extension)
   return path.string();
 }
 
+std::vector<std::vector<float>> makeGaussianSamples(cv::RNG& rng, int count, int dim, double sigma) {
+  std::vector<std::vector<float>> samples(count, std::vector<float>(dim));
+  for (auto& sample : samples) {
+    for (auto& value : sample) value = static_cast<float>(rng.gaussian(sigma));
+  }
+  return samples;
+}
+
+CradleFunctions::MarkedSegments makeSegmentLayout(const cv::Size& size) {
+  CradleFunctions::MarkedSegments segments;
+  segments.pieces = 2;
+  segments.piece_mask = cv::Mat(size, CV_16U, cv::Scalar(0));
+  segments.piece_middle.push_back(cv::Point2i(size.width / 2, size.height / 2));
+  segments.piece_type.push_back(CradleFunctions::VERTICAL_DIR);
+  segments.pieceIDh = {};
+  segments.pieceIDv = {{1}};
+  return segments;
+}
+
+CradleFunctions::MarkedSegments makeSingleStripSegments(const cv::Size& size) {
+  CradleFunctions::MarkedSegments segments = makeSegmentLayout(size);
+  segments.piece_mask(cv::Rect(100, 0, 40, size.height)).setTo(1);
+  return segments;
+}
+
+TextureRun makeMultiBlockRun(int strips) {
+  TextureRun run;
+  run.image = cv::Mat(1000, 300, CV_32F);
+  cv::randu(run.image, 0.0f, 255.0f);
+  run.mask = makeEmptyMask(run.image);
+  run.segments = makeSingleStripSegments(run.image.size());
+  if (strips > 1) {
+    run.segments.pieces = 3;
+    run.segments.piece_mask(cv::Rect(200, 0, 40, run.image.rows)).setTo(2);
+    run.segments.piece_middle.push_back(cv::Point2i(220, run.image.rows / 2));
+    run.segments.piece_type.push_back(CradleFunctions::VERTICAL_DIR);
+    run.segments.pieceIDv.push_back({2});
+  }
+  return run;
+}
+
+int sampledBlockCount(const TextureRun& run) {
+  TextureRemoval::block_plan plan =
+      TextureRemoval::planBlocks(run.mask, run.segments.piece_mask, TextureRemoval::block_layout());
+  return static_cast<int>(std::count(plan.sampled.begin(), plan.sampled.end(), true));
+}
+
+cv::Mat removeTexture(const TextureRun& run, const TextureRemoval::texture_removal_options& options) {
+  cv::Mat image = run.image, mask = run.mask, out;
+  TextureRemoval::textureRemove(image, mask, out, run.segments, options);
+  return out;
+}
+
+ScratchDirectory::ScratchDirectory(const std::string& stem) : path_(temporaryPath(stem, "")) {
+  fs::create_directories(path_);
+}
+
+ScratchDirectory::~ScratchDirectory() {
+  std::error_code ignored;
+  fs::remove_all(path_, ignored);
+}
+
 }  // namespace test_helpers
@@ -1,8 +1,12 @@
 #ifndef PLATYPUS_TEST_HELPERS_H
 #define PLATYPUS_TEST_HELPERS_H
 
+#include <platypus/CradleFunctions.h>
+#include <platypus/TextureRemoval.h>
+
 #include <opencv2/core.hpp>
 #include <string>
+#include <vector>
 
 namespace test_helpers {
 
@@ -12,6 +16,48 @@ cv::Mat makeEmptyMask(const cv::Mat& image);
 bool isFinite(const cv::Mat& image);
 std::string temporaryPath(const std::string& stem, const std::string& extension);
 
+// 'count' feature vectors of 'dim' independent N(0, sigma^2) values
+std::vector<std::vector<float>> makeGaussianSamples(cv::RNG& rng, int count, int dim, double sigma);
+
+// One vertical cradle piece (id 1) with no pixels marked yet
+CradleFunctions::MarkedSegments makeSegmentLayout(const cv::Size& size);
+
+// makeSegmentLayout() with the piece covering columns [100, 140) over the full height
+CradleFunctions::MarkedSegments makeSingleStripSegments(const cv::Size& size);
+
+// textureRemove() input: an image, its (empty) defect mask and the marked pieces
+struct TextureRun {
+  cv::Mat image;
+  cv::Mat mask;
+  CradleFunctions::MarkedSegments segments;
+};
+
+// Random texture of 1000 x 300 pixels with makeSingleStripSegments(): the strip spans several
+// processing blocks and texture tiles, so a cache with room for less than the run has to evict.
+// With two strips, a second vertical piece (id 2) covers columns [200, 240).
+TextureRun makeMultiBlockRun(int strips = 1);
+
+// Processing blocks of 'run' sampled with the default layout
+int sampledBlockCount(const TextureRun& run);
+
+// Texture-removed image of 'run'
+cv::Mat removeTexture(const TextureRun& run,
+                      const TextureRemoval::texture_removal_options& options = TextureRemoval::texture_removal_options());
+
+// Empty directory under the temporary path, removed with its contents on destruction
+class ScratchDirectory {
+ public:
+  explicit ScratchDirectory(const std::string& stem);
+  ~ScratchDirectory();
+  ScratchDirectory(const ScratchDirectory&) = delete;
+  ScratchDirectory& operator=(const ScratchDirectory&) = delete;
+
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+};
+
 }  // namespace test_helpers
 
 #endif
@@ -0,0 +1,69 @@
+// Times textureRemove() over the supported block sizes and a range of block overlaps and reports the
+// fastest layout. Smaller blocks shrink the transforms and the per-block coefficient cache, larger ones
+// need fewer blocks and seams.
+//
+//   platypus_texture_benchmark [image] [repeats]
+//
+// Without an image, the cradle fixture is cradle-removed first and used as input.
+
+#include "test_helpers.h"
+
+#include <platypus/CradleFunctions.h>
+#include <platypus/TextureRemoval.h>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char** argv) {
+  cv::Mat image;
+  if (argc > 1) {
+    cv::imread(argv[1], cv::IMREAD_GRAYSCALE).convertTo(image, CV_32F);
+    if (image.empty()) {
+      std::fprintf(stderr, "Could not read '%s'\n", argv[1]);
+      return 1;
+    }
+  } else {
+    image = test_helpers::loadFixtureGrayscaleFloat("cradle.jpg");
+  }
+  const int repeats = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1;
+
+  cv::Mat mask = test_helpers::makeEmptyMask(image);
+  cv::Mat input, cradle;
+  CradleFunctions::MarkedSegments segments;
+  CradleFunctions::removeCradle(image, input, cradle, mask, segments);
+
+  TextureRemoval::block_layout fastest;
+  double fastest_seconds = -1.0;
+
+  std::printf("%6s %8s %12s %10s\n", "size", "overlap", "MB/block", "seconds");
+  for (int size : {256, 512, 1024}) for (int overlap : {16, 32, 48, 64, 96}) {
+    TextureRemoval::texture_removal_options options;
+    options.layout.size = size;
+    options.layout.overlap = overlap;
+    if (!TextureRemoval::validBlockLayout(options.layout)) continue;
+
+    double best = -1.0;
+    for (int r = 0; r < repeats; ++r) {
+      cv::Mat out;
+      auto start = std::chrono::steady_clock::now();
+      TextureRemoval::textureRemove(input, mask, out, segments, options);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (best < 0.0 || seconds < best) best = seconds;
+    }
+    // a block resident in the coefficient cache keeps every subband of its transform
+    const double block_mb = 61.0 * size * size * sizeof(float) / (1 << 20);
+    std::printf("%6d %8d %12.1f %10.2f\n", size, overlap, block_mb, best);
+    if (fastest_seconds < 0.0 || best < fastest_seconds) {
+      fastest_seconds = best;
+      fastest = options.layout;
+    }
+  }
+  std::printf("fastest: %dx%d blocks with overlap %d (%.2f s)\n", fastest.size, fastest.size, fastest.overlap,
+              fastest_seconds);
+  return 0;
+}